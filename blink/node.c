@@ -84,9 +84,14 @@ int blink_node_need_move_right(blink_node *bn, const void *key, uint32_t len)
 
 void blink_node_insert_infinity_key(blink_node *bn)
 {
+#ifdef FixedKey
+  uint32_t len = fixed_key_size;
+#else
+  uint32_t len = max_key_size;
+#endif
   char key[max_key_size];
-  memset(key, 0xff, max_key_size);
-  assert(blink_node_insert(bn, key, max_key_size, 0) == 1);
+  memset(key, 0xff, len);
+  assert(blink_node_insert(bn, key, len, 0) == 1);
 }
 
 #ifdef Test
@@ -11,6 +11,12 @@
 
 /* a simple example as how to use palm tree */
 
+static void on_done(void *b, void *arg)
+{
+  (void)b;
+  *(int *)arg = 1;
+}
+
 int main()
 {
   static const char *hello = "hello";
@@ -18,16 +24,19 @@ int main()
 
   palm_tree *pt = new_palm_tree(2 /* thread_number */, 4 /* queue_size */);
 
+  int done = 0;
   batch *b1 = new_batch();
   batch_add_write(b1, (const void *)hello, 5, (const void *)world);
-  palm_tree_execute(pt, b1);
+  palm_tree_execute_callback(pt, b1, on_done, (void *)&done);
 
   batch *b2 = new_batch();
   batch_add_read(b2, (const void *)hello, 5); // index 0
-  palm_tree_execute(pt, b2);
+  uint64_t ticket = palm_tree_execute(pt, b2);
 
-  // wait until all the batch be executed
-  palm_tree_flush(pt);
+  // wait until b2 is executed, batches before it are executed as well,
+  // use `palm_tree_poll` if you don't want to block, or `palm_tree_flush` to wait for all
+  palm_tree_wait(pt, ticket);
+  assert(done && palm_tree_poll(pt, ticket));
 
   const char *value = (const char *)batch_get_value_at(b2, 0);
   assert(value == world);
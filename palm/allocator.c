@@ -11,12 +11,21 @@
 #include <assert.h>
 #include <sys/mman.h>
 #include <pthread.h>
+#if defined(Numa) && defined(__linux__)
+#include <unistd.h>
+#include <sys/syscall.h>
+#endif
 
 #include "allocator.h"
 
 #define likely(x)   (__builtin_expect(!!(x), 1))
 #define unlikely(x) (__builtin_expect(!!(x), 0))
 
+#if defined(Numa) && defined(__linux__)
+#define mpol_local 4 // MPOL_LOCAL in <numaif.h>, we don't want to depend on libnuma
+static int mbind_denied = 0;
+#endif
+
 static pthread_key_t key;
 static int initialized = 0;
 static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
@@ -46,6 +55,13 @@ static inline block* new_block(block *meta)
     b->buffer = mmap(0, block_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
     #endif
     assert(b->buffer != MAP_FAILED);
+    #if defined(Numa) && defined(__linux__)
+    // pages are allocated from the numa node of the thread that first touches them,
+    // even if process memory policy is interleave, so that a pinned worker gets local nodes,
+    // if mbind is denied (e.g. in a container) we stay with the default first touch policy
+    if (!mbind_denied && syscall(SYS_mbind, b->buffer, block_size, mpol_local, 0, 0, 0) != 0)
+      mbind_denied = 1;
+    #endif
     b->now = 0;
     b->tot = block_size;
     b->next = 0;
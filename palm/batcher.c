@@ -0,0 +1,266 @@
+/**
+ *    author:     UncP
+ *    date:    2019-04-02
+ *    license:    BSD-3
+**/
+
+#include <stdlib.h>
+#include <time.h>
+#include <assert.h>
+
+#include "batcher.h"
+
+// monotonic time in microseconds
+static uint64_t now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+// wait until current batch can take kvs, caller must hold the mutex
+static void batcher_wait_ready(batcher *bt)
+{
+  while (!bt->ready)
+    pthread_cond_wait(&bt->slot, &bt->mutex);
+}
+
+// execute current batch and move to the next one, caller must hold the mutex,
+// the mutex is released while waiting for the next batch so that other threads are not
+// blocked by a slow batch, kvs can not be added until the next batch is ready
+static void batcher_seal(batcher *bt)
+{
+  batch *b = bt->batches[bt->cur];
+  if (batch_get_keys(b) == 0) return ;
+
+  assert(bt->ready);
+  bt->tickets[bt->cur] = palm_tree_execute_callback(bt->pt, b, bt->cb, bt->arg);
+  bt->cur = bt->cur + 1 == bt->total ? 0 : bt->cur + 1;
+  ++bt->round;
+  bt->opened = 0;
+  bt->ready = 0;
+  uint64_t ticket = bt->tickets[bt->cur];
+
+  // next batch may still be in the palm tree
+  pthread_mutex_unlock(&bt->mutex);
+  palm_tree_wait(bt->pt, ticket);
+  pthread_mutex_lock(&bt->mutex);
+
+  batch_clear(bt->batches[bt->cur]);
+  bt->rounds[bt->cur] = bt->round;
+  bt->ready = 1;
+  pthread_cond_broadcast(&bt->slot);
+}
+
+static void* batcher_timer(void *arg)
+{
+  batcher *bt = (batcher *)arg;
+
+  pthread_mutex_lock(&bt->mutex);
+  while (bt->running) {
+    // sleep until somebody adds a kv to an empty batch
+    if (bt->opened == 0) {
+      pthread_cond_wait(&bt->cond, &bt->mutex);
+      continue;
+    }
+
+    uint64_t expire = bt->opened + bt->deadline;
+    if (now() >= expire) {
+      batcher_seal(bt);
+      continue;
+    }
+
+    // woken up early if current batch is sealed because it's full
+    struct timespec ts;
+    ts.tv_sec  = expire / 1000000;
+    ts.tv_nsec = (expire % 1000000) * 1000;
+    pthread_cond_timedwait(&bt->cond, &bt->mutex, &ts);
+  }
+  pthread_mutex_unlock(&bt->mutex);
+
+  return 0;
+}
+
+// `total` batches are used in rotation, `deadline` is in microseconds,
+// if `deadline` is 0, a batch is only sealed when it's full or flushed
+batcher* new_batcher(palm_tree *pt, uint32_t total, uint64_t deadline, batch_callback cb, void *arg)
+{
+  if (total == 0) total = 1;
+
+  batcher *bt = (batcher *)malloc(sizeof(batcher));
+  bt->pt = pt;
+  bt->total = total;
+  bt->cur = 0;
+  bt->batches = (batch **)malloc(sizeof(batch *) * total);
+  bt->tickets = (uint64_t *)malloc(sizeof(uint64_t) * total);
+  bt->rounds = (uint64_t *)malloc(sizeof(uint64_t) * total);
+  for (uint32_t i = 0; i < total; ++i) {
+    bt->batches[i] = new_batch();
+    bt->tickets[i] = 0; // ticket 0 is always done
+    bt->rounds[i] = (uint64_t)-1; // not used yet
+  }
+  bt->rounds[0] = 0;
+  bt->round = 0;
+  bt->ready = 1;
+
+  bt->deadline = deadline;
+  bt->opened = 0;
+  bt->cb = cb;
+  bt->arg = arg;
+
+  assert(pthread_mutex_init(&bt->mutex, 0) == 0);
+  pthread_condattr_t attr;
+  assert(pthread_condattr_init(&attr) == 0);
+  assert(pthread_condattr_setclock(&attr, CLOCK_MONOTONIC) == 0);
+  assert(pthread_cond_init(&bt->cond, &attr) == 0);
+  pthread_condattr_destroy(&attr);
+  assert(pthread_cond_init(&bt->slot, 0) == 0);
+
+  bt->running = deadline != 0;
+  if (bt->running)
+    assert(pthread_create(&bt->timer, 0, batcher_timer, (void *)bt) == 0);
+
+  return bt;
+}
+
+void free_batcher(batcher *bt)
+{
+  batcher_flush(bt);
+
+  if (bt->running) {
+    pthread_mutex_lock(&bt->mutex);
+    bt->running = 0;
+    pthread_cond_signal(&bt->cond);
+    pthread_mutex_unlock(&bt->mutex);
+    assert(pthread_join(bt->timer, 0) == 0);
+  }
+
+  pthread_mutex_destroy(&bt->mutex);
+  pthread_cond_destroy(&bt->cond);
+  pthread_cond_destroy(&bt->slot);
+
+  for (uint32_t i = 0; i < bt->total; ++i)
+    free_batch(bt->batches[i]);
+  free((void *)bt->batches);
+  free((void *)bt->tickets);
+  free((void *)bt->rounds);
+
+  free((void *)bt);
+}
+
+static int batcher_add_to(batch *b, uint32_t op, const void *key, uint32_t len, const void *val,
+  const void *expect)
+{
+  switch (op) {
+    case Write:  return batch_add_write(b, key, len, val);
+    case Read:   return batch_add_read(b, key, len);
+    case Delete: return batch_add_delete(b, key, len);
+    case Add:    return batch_add_add(b, key, len, val);
+    case Cas:    return batch_add_cas(b, key, len, expect, val);
+    case GetOrInsert: return batch_add_get_or_insert(b, key, len, val);
+    default: assert(0);
+  }
+  return -1;
+}
+
+static uint64_t batcher_add(batcher *bt, uint32_t op, const void *key, uint32_t len, const void *val,
+  const void *expect)
+{
+  pthread_mutex_lock(&bt->mutex);
+  batcher_wait_ready(bt);
+
+  if (batcher_add_to(bt->batches[bt->cur], op, key, len, val, expect) == -1) {
+    // batch is full
+    batcher_seal(bt);
+    assert(batcher_add_to(bt->batches[bt->cur], op, key, len, val, expect) == 1);
+  }
+
+  uint64_t handle = (bt->round << 32) | (batch_get_keys(bt->batches[bt->cur]) - 1);
+
+  // start the clock for current batch
+  if (bt->opened == 0) {
+    bt->opened = now();
+    if (bt->running)
+      pthread_cond_signal(&bt->cond);
+  }
+
+  pthread_mutex_unlock(&bt->mutex);
+
+  return handle;
+}
+
+uint64_t batcher_add_write(batcher *bt, const void *key, uint32_t len, const void *val)
+{
+  return batcher_add(bt, Write, key, len, val, 0);
+}
+
+uint64_t batcher_add_read(batcher *bt, const void *key, uint32_t len)
+{
+  return batcher_add(bt, Read, key, len, 0, 0);
+}
+
+uint64_t batcher_add_delete(batcher *bt, const void *key, uint32_t len)
+{
+  return batcher_add(bt, Delete, key, len, 0, 0);
+}
+
+uint64_t batcher_add_add(batcher *bt, const void *key, uint32_t len, const void *val)
+{
+  return batcher_add(bt, Add, key, len, val, 0);
+}
+
+uint64_t batcher_add_cas(batcher *bt, const void *key, uint32_t len, const void *expect, const void *val)
+{
+  return batcher_add(bt, Cas, key, len, val, expect);
+}
+
+uint64_t batcher_add_get_or_insert(batcher *bt, const void *key, uint32_t len, const void *val)
+{
+  return batcher_add(bt, GetOrInsert, key, len, val, 0);
+}
+
+// wait until the kv of `handle` is done and return its result, see `batch_get_result`,
+// current batch is sealed if the kv is still in it, return `Expired` if its batch has been
+// reused before or while waiting, `val` is untouched then
+uint32_t batcher_get_result(batcher *bt, uint64_t handle, void **val)
+{
+  uint64_t round = handle >> 32;
+  uint32_t seq = (uint32_t)handle;
+  uint32_t idx = round % bt->total;
+  uint32_t status = Expired;
+
+  pthread_mutex_lock(&bt->mutex);
+  batcher_wait_ready(bt);
+  if (round == bt->round)
+    batcher_seal(bt);
+  if (unlikely(bt->rounds[idx] != round)) {
+    pthread_mutex_unlock(&bt->mutex);
+    return status;
+  }
+  uint64_t ticket = bt->tickets[idx];
+  pthread_mutex_unlock(&bt->mutex);
+
+  palm_tree_wait(bt->pt, ticket);
+
+  // batch may be reused by other threads while we wait
+  pthread_mutex_lock(&bt->mutex);
+  if (likely(bt->rounds[idx] == round))
+    status = batch_get_result(bt->batches[idx], seq, val);
+  pthread_mutex_unlock(&bt->mutex);
+
+  return status;
+}
+
+// execute current batch and wait until all the batches from this batcher are done
+void batcher_flush(batcher *bt)
+{
+  pthread_mutex_lock(&bt->mutex);
+  batcher_wait_ready(bt);
+  batcher_seal(bt);
+  uint32_t last = bt->cur == 0 ? bt->total - 1 : bt->cur - 1;
+  uint64_t ticket = bt->tickets[last];
+  pthread_mutex_unlock(&bt->mutex);
+
+  // batches are done in order, so waiting for the last one is enough
+  palm_tree_wait(bt->pt, ticket);
+}
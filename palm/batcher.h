@@ -0,0 +1,67 @@
+/**
+ *    author:     UncP
+ *    date:    2019-04-02
+ *    license:    BSD-3
+**/
+
+#ifndef _batcher_h_
+#define _batcher_h_
+
+#include <pthread.h>
+
+#include "palm_tree.h"
+
+/**
+ *   batcher builds batches for palm tree on behalf of multiple client threads,
+ *   a batch is sealed and executed when it is full or when the first kv in it has waited
+ *   for `deadline` microseconds, so that latency is bounded when traffic is light.
+ *
+ *   batches are used in rotation, a batch is reused only after its ticket is done,
+ *   `cb` (if any) is called on each finished batch.
+ *
+ *   every `batcher_add_*` returns a handle of its kv (round of the batch << 32 | seq), which is
+ *   passed to `batcher_get_result` to get the result, a result can be read until its batch is
+ *   reused, that is `total` rounds later, after that `batcher_get_result` returns `Expired`.
+**/
+
+// result status of a handle whose batch has been reused, see `batcher_get_result`
+#define Expired 6
+
+typedef struct batcher
+{
+  palm_tree *pt;
+
+  uint32_t   total;    // number of batches in rotation
+  uint32_t   cur;      // index of the batch being filled
+  batch    **batches;
+  uint64_t  *tickets;  // ticket of each batch when it's executed
+  uint64_t  *rounds;   // round of each batch, round of a batch increases by `total` each time it's reused
+  uint64_t   round;    // round of current batch
+  int        ready;    // whether current batch is cleared and can take kvs
+
+  uint64_t   deadline; // in microseconds
+  uint64_t   opened;   // when the first kv is added to current batch, 0 if it's empty
+
+  batch_callback  cb;
+  void           *arg;
+
+  int        running;
+  pthread_t  timer;    // seals the current batch when deadline passes
+
+  pthread_mutex_t mutex;
+  pthread_cond_t  cond;
+  pthread_cond_t  slot;  // signaled when current batch is ready
+}batcher;
+
+batcher* new_batcher(palm_tree *pt, uint32_t total, uint64_t deadline, batch_callback cb, void *arg);
+void free_batcher(batcher *bt);
+uint64_t batcher_add_write(batcher *bt, const void *key, uint32_t len, const void *val);
+uint64_t batcher_add_read(batcher *bt, const void *key, uint32_t len);
+uint64_t batcher_add_delete(batcher *bt, const void *key, uint32_t len);
+uint64_t batcher_add_add(batcher *bt, const void *key, uint32_t len, const void *val);
+uint64_t batcher_add_cas(batcher *bt, const void *key, uint32_t len, const void *expect, const void *val);
+uint64_t batcher_add_get_or_insert(batcher *bt, const void *key, uint32_t len, const void *val);
+uint32_t batcher_get_result(batcher *bt, uint64_t handle, void **val);
+void batcher_flush(batcher *bt);
+
+#endif /* _batcher_h_ */
@@ -12,26 +12,37 @@
 
 #include "bounded_queue.h"
 
+// how many times we check the condition before we go to sleep
+#define spin_times 1024
+
 bounded_queue* new_bounded_queue(int total)
 {
   if (total <= 0) total = 1;
-  // we don't use a big queue to avoid too much batch memory
-  if (total >= 8) total = 8;
 
   void *q_buf;
   assert(posix_memalign(&q_buf, 64, sizeof(bounded_queue)) == 0);
   bounded_queue *q = (bounded_queue *)q_buf;
 
-  q->total = total;
-  q->head  = 0;
-  q->tail  = 0;
-  q->size  = 0;
-  q->clear = 0;
-
-  void *array;
-  assert(posix_memalign(&array, 64, sizeof(void *) * q->total) == 0);
-  memset(array, 0, sizeof(void *) * q->total);
-  q->array = (void **)array;
+  // round up to power of 2 so that we can use mask to get the slot, and there are at least 2 slots,
+  // otherwise a filled slot (`pos + 1`) looks free to the producer at `pos + 1`
+  q->total = 2;
+  while (q->total < (uint64_t)total)
+    q->total <<= 1;
+  q->mask    = q->total - 1;
+  q->clear   = 0;
+  q->tail    = 0;
+  q->head    = 0;
+  q->waiters = 0;
+
+  void *slots;
+  assert(posix_memalign(&slots, 64, sizeof(slot) * q->total) == 0);
+  q->slots = (slot *)slots;
+  for (uint64_t i = 0; i < q->total; ++i) {
+    q->slots[i].seq = i;
+    q->slots[i].element = 0;
+    q->slots[i].callback = 0;
+    q->slots[i].arg = 0;
+  }
 
   assert(pthread_mutex_init(&q->mutex, 0) == 0);
   assert(pthread_cond_init(&q->cond, 0) == 0);
@@ -44,91 +55,185 @@ void free_bounded_queue(bounded_queue *q)
   pthread_mutex_destroy(&q->mutex);
   pthread_cond_destroy(&q->cond);
 
-  free((void *)q->array);
+  free((void *)q->slots);
 
   free((void *)q);
 }
 
-void bounded_queue_wait_empty(bounded_queue *q)
+typedef int (*queue_ready)(bounded_queue *q, uint64_t pos);
+
+// slot at `pos` is free or has been taken by another producer
+static int slot_is_free(bounded_queue *q, uint64_t pos)
+{
+  uint64_t seq = __atomic_load_n(&q->slots[pos & q->mask].seq, __ATOMIC_ACQUIRE);
+  return (int64_t)(seq - pos) >= 0;
+}
+
+// slot at `pos` is filled by producer
+static int slot_is_filled(bounded_queue *q, uint64_t pos)
+{
+  return __atomic_load_n(&q->slots[pos & q->mask].seq, __ATOMIC_ACQUIRE) == pos + 1;
+}
+
+// all the elements have been dequeued
+static int queue_is_empty(bounded_queue *q, uint64_t pos)
+{
+  (void)pos;
+  return __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) == __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+}
+
+static inline int queue_is_clear(bounded_queue *q)
 {
+  return (int)__atomic_load_n(&q->clear, __ATOMIC_ACQUIRE);
+}
+
+// element at `pos` has been dequeued
+static int slot_is_done(bounded_queue *q, uint64_t pos)
+{
+  return __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) > pos;
+}
+
+// spin for a while, if the condition is still not satisfied, sleep until we are notified
+static void queue_wait(bounded_queue *q, queue_ready ready, uint64_t pos)
+{
+  for (int i = 0; i < spin_times; ++i)
+    if (ready(q, pos) || queue_is_clear(q))
+      return ;
+
   pthread_mutex_lock(&q->mutex);
 
-  // wait until all the queue elements have been processed
-  while (q->size)
+  __atomic_fetch_add(&q->waiters, 1, __ATOMIC_SEQ_CST);
+  // pair with the fence in `queue_notify`, either we see the change or the notifier sees us
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  while (!ready(q, pos) && !queue_is_clear(q))
     pthread_cond_wait(&q->cond, &q->mutex);
+  __atomic_fetch_sub(&q->waiters, 1, __ATOMIC_SEQ_CST);
 
   pthread_mutex_unlock(&q->mutex);
 }
 
-void bounded_queue_clear(bounded_queue *q)
+// wake up the sleeping threads, if there is none, mutex is not touched
+static void queue_notify(bounded_queue *q)
 {
-  pthread_mutex_lock(&q->mutex);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&q->waiters, __ATOMIC_SEQ_CST)) {
+    pthread_mutex_lock(&q->mutex);
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->mutex);
+  }
+}
 
+void bounded_queue_wait_empty(bounded_queue *q)
+{
   // wait until all the queue elements have been processed
-  while (q->size)
-    pthread_cond_wait(&q->cond, &q->mutex);
+  if (!queue_is_empty(q, 0))
+    queue_wait(q, queue_is_empty, 0);
+}
 
-  q->clear = 1;
-  pthread_cond_broadcast(&q->cond);
+void bounded_queue_clear(bounded_queue *q)
+{
+  // wait until all the queue elements have been processed
+  while (!queue_is_empty(q, 0))
+    queue_wait(q, queue_is_empty, 0);
 
-  pthread_mutex_unlock(&q->mutex);
+  __atomic_store_n(&q->clear, 1, __ATOMIC_RELEASE);
+  queue_notify(q);
 }
 
-void bounded_queue_enqueue(bounded_queue *q, void *element)
+// return the position of `element`, it can be used to poll or wait for its completion,
+// `cb` will be called with `arg` when all the workers finish `element`
+uint64_t bounded_queue_enqueue(bounded_queue *q, void *element, element_callback cb, void *arg)
 {
   assert(element);
 
-  pthread_mutex_lock(&q->mutex);
+  uint64_t pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+  while (1) {
+    if (queue_is_clear(q))
+      return pos;
+
+    uint64_t seq = __atomic_load_n(&q->slots[pos & q->mask].seq, __ATOMIC_ACQUIRE);
+    int64_t diff = (int64_t)(seq - pos);
+    if (diff == 0) {
+      // slot is free, try to take it, `pos` is updated if we fail
+      if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, 1 /* weak */, __ATOMIC_RELAXED,
+        __ATOMIC_RELAXED))
+        break;
+    } else if (diff < 0) {
+      // queue is full, wait until worker dequeues this slot
+      queue_wait(q, slot_is_free, pos);
+      pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    } else {
+      // slot has been taken by another producer
+      pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    }
+  }
 
-  while (q->array[q->tail] && !q->clear)
-    pthread_cond_wait(&q->cond, &q->mutex);
+  slot *s = &q->slots[pos & q->mask];
+  s->element  = element;
+  s->callback = cb;
+  s->arg      = arg;
+  // publish the element to workers
+  __atomic_store_n(&s->seq, pos + 1, __ATOMIC_RELEASE);
 
-  if (!q->clear) {
-    q->array[q->tail++] = element;
-    ++q->size;
-    if (q->tail == q->total)
-      q->tail = 0;
-    // wake up all the workers
-    pthread_cond_broadcast(&q->cond);
-  }
+  queue_notify(q);
 
-  pthread_mutex_unlock(&q->mutex);
+  return pos;
 }
 
-// return the element at `idx` but don't proceed `q->head`
-void* bounded_queue_get_at(bounded_queue *q, int *idx)
+// whether element at `pos` is done, always true if the queue is cleared
+int bounded_queue_is_done(bounded_queue *q, uint64_t pos)
 {
-  pthread_mutex_lock(&q->mutex);
+  return slot_is_done(q, pos) || queue_is_clear(q);
+}
 
-  while (!q->array[*idx] && !q->clear)
-    pthread_cond_wait(&q->cond, &q->mutex);
+void bounded_queue_wait_done(bounded_queue *q, uint64_t pos)
+{
+  if (!slot_is_done(q, pos))
+    queue_wait(q, slot_is_done, pos);
+}
 
-  void *r;
-  if (!q->clear) {
-    r = q->array[*idx];
-    if (++(*idx) == q->total)
-      *idx = 0;
-  } else {
-    r = 0;
+// return the element at `idx` and proceed `idx`, but don't proceed `q->head`,
+// return 0 if the queue is cleared
+void* bounded_queue_get_at(bounded_queue *q, uint64_t *idx)
+{
+  uint64_t pos = *idx;
+
+  if (!slot_is_filled(q, pos)) {
+    queue_wait(q, slot_is_filled, pos);
+    if (!slot_is_filled(q, pos))
+      return 0;
   }
 
-  pthread_mutex_unlock(&q->mutex);
-  return r;
+  ++(*idx);
+  return q->slots[pos & q->mask].element;
 }
 
-void bounded_queue_dequeue(bounded_queue *q)
+// return the element at `pos` if it's already in the queue, 0 otherwise, never blocks
+void* bounded_queue_peek_at(bounded_queue *q, uint64_t pos)
 {
-  pthread_mutex_lock(&q->mutex);
+  if (!slot_is_filled(q, pos))
+    return 0;
+  return q->slots[pos & q->mask].element;
+}
 
-  assert(q->array[q->head]);
+// only called by one worker after all the workers finish the element at `q->head`
+void bounded_queue_dequeue(bounded_queue *q)
+{
+  uint64_t pos = q->head;
+  slot *s = &q->slots[pos & q->mask];
 
-  q->array[q->head] = 0;
-  --q->size;
+  assert(s->seq == pos + 1);
 
-  if (++q->head == q->total)
-    q->head = 0;
+  // callback is done before `head` proceeds, so that waiter knows the element is no longer used
+  if (s->callback)
+    s->callback(s->element, s->arg);
 
-  pthread_cond_signal(&q->cond);
+  s->element  = 0;
+  s->callback = 0;
+  s->arg      = 0;
+  // slot is free for the producer in next round
+  __atomic_store_n(&s->seq, pos + q->total, __ATOMIC_RELEASE);
+  __atomic_store_n(&q->head, pos + 1, __ATOMIC_RELEASE);
 
-  pthread_mutex_unlock(&q->mutex);
+  queue_notify(q);
 }
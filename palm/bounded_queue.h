@@ -7,17 +7,52 @@
 #ifndef _bounded_queue_h_
 #define _bounded_queue_h_
 
+#include <stdint.h>
 #include <pthread.h>
 
+/**
+ *   bounded queue is a lock-free ring with sequence number in each slot,
+ *   multiple producers enqueue with a single CAS, every worker reads every element
+ *   with atomic loads, and the element is dequeued by one worker after all workers finish it.
+ *
+ *   sequence number of slot at position `pos`:
+ *     pos             slot is free for producer at `pos`
+ *     pos + 1         slot is filled, workers can read it
+ *     pos + total     slot is dequeued, free for producer at `pos + total`
+ *
+ *   waiters spin for a while and then sleep on a condition variable,
+ *   mutex is only touched when somebody is sleeping.
+ *
+ *   position returned by enqueue is the completion handle of the element, element at `pos`
+ *   is done once `head` passes `pos`, its callback (if any) is called right before that.
+**/
+
+// called by the dequeuing worker when all the workers finish `element`
+typedef void (*element_callback)(void *element, void *arg);
+
+typedef struct slot
+{
+  uint64_t          seq;      // sequence number
+  void             *element;
+  element_callback  callback;
+  void             *arg;
+}slot;
+
 typedef struct bounded_queue
 {
-  int total;
-  int head; // point to the slot which to enqueue
-  int tail; // point to the slot which to dequeue
-  int size;
-  int clear;
+  uint64_t total; // must be power of 2, and at least 2
+  uint64_t mask;
+  uint64_t clear;
+  uint64_t pad0[5];
+
+  uint64_t tail;  // position to enqueue, producers compete for it
+  uint64_t pad1[7];
+
+  uint64_t head;  // position to dequeue, only modified by one worker
+  uint64_t pad2[7];
 
-  void **array;
+  uint64_t waiters; // number of threads sleeping on `cond`
+  slot    *slots;
 
   pthread_mutex_t mutex;
 
@@ -28,8 +63,11 @@ bounded_queue* new_bounded_queue(int total);
 void free_bounded_queue(bounded_queue *q);
 void bounded_queue_wait_empty(bounded_queue *q);
 void bounded_queue_clear(bounded_queue *q);
-void bounded_queue_enqueue(bounded_queue *q, void *element);
-void* bounded_queue_get_at(bounded_queue *q, int *idx);
+uint64_t bounded_queue_enqueue(bounded_queue *q, void *element, element_callback cb, void *arg);
+int bounded_queue_is_done(bounded_queue *q, uint64_t pos);
+void bounded_queue_wait_done(bounded_queue *q, uint64_t pos);
+void* bounded_queue_get_at(bounded_queue *q, uint64_t *idx);
+void* bounded_queue_peek_at(bounded_queue *q, uint64_t pos);
 void bounded_queue_dequeue(bounded_queue *q);
 
-#endif /* _bounded_queue_h_ */
\ No newline at end of file
+#endif /* _bounded_queue_h_ */
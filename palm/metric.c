@@ -130,9 +130,9 @@ void show_metric()
 
   printf("cpu: %llu us    total: %llu us\n", all.cpu, all.tot);
   for (int i = 0; i < m->len; ++i) {
-    printf("%-24s:  cpu: %5.2f %%  tot: %5.2f %%\n", m->name[i],
-      (float)clocks[i].cpu / all.cpu * 100,
-      (float)clocks[i].tot / all.tot * 100);
+    printf("%-24s:  cpu: %5.2f %% %10llu us  tot: %5.2f %% %10llu us\n", m->name[i],
+      (float)clocks[i].cpu / all.cpu * 100, clocks[i].cpu,
+      (float)clocks[i].tot / all.tot * 100, clocks[i].tot);
   }
 }
 
@@ -9,6 +9,9 @@
 #include <assert.h>
 // TODO: remove this
 #include <stdio.h>
+#if defined(Fingerprint) && defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "allocator.h"
 #include "node.h"
@@ -19,6 +22,10 @@ static uint32_t node_offset = 0;
 static uint32_t node_id = 0;
 
 #define node_size_mask (~0xfff)
+#define node_kb_mask   (~0x3ff)
+
+// bytes a node can use, for blink node the first `node_offset` bytes are not part of it
+#define node_bytes(n) ((((uint32_t)(n)->size) << 10) - node_offset)
 
 void set_node_size(uint32_t size)
 {
@@ -42,6 +49,15 @@ uint32_t get_batch_size()
   return batch_size;
 }
 
+// node size for nodes in `level` of a palm tree, leaf needs at least `node_min_size`,
+// branch only holds separators so it can be as small as `branch_min_size`
+uint32_t get_level_node_size(uint8_t level, uint32_t size)
+{
+  uint32_t min = level ? branch_min_size : node_min_size;
+  size = size < min ? min : size > node_max_size ? node_max_size : size;
+  return size & (level ? node_kb_mask : node_size_mask);
+}
+
 // for blink node, `node_size` is not really node size
 void set_node_offset(uint32_t offset)
 {
@@ -54,7 +70,7 @@ void set_node_offset(uint32_t offset)
 #define get_len(n, off) ((uint32_t)(*(len_t *)get_ptr(n, off)))
 #define get_key(n, off) (get_ptr(n, off) + key_byte)
 #define get_val(n, off) ((void *)(*(val_t *)(get_key(n, off) + get_len(n, off))))
-#define node_index(n)   ((index_t *)((char *)n + (node_size - node_offset - (n->keys * index_byte))))
+#define node_index(n)   ((index_t *)((char *)n + (node_bytes(n) - (n->keys * index_byte))))
 #define batch_index(n)   ((index_t *)((char *)n + (batch_size - (n->keys * index_byte))))
 #define get_key_info(n, off, key, len) \
   const void *key = get_key(n, off);   \
@@ -74,11 +90,313 @@ int compare_key(const void *key1, uint32_t len1, const void *key2, uint32_t len2
   return r ? r : (len1 == len2 ? 0 : (len1 < len2 ? -1 : +1));
 }
 
+#ifndef FixedKey
+
+/****** FINGERPRINT operation ******/
+
+// leaf can keep one byte hash of each key suffix right below its index, `fp[i]` is for `index[i]`,
+// they live in the free space so they are only valid (sopt == 1) when there is room for them,
+// a point lookup then scans the hashes instead of doing a binary search
+#define node_fp(n) ((uint8_t *)node_index(n) - n->keys)
+
+#ifdef Fingerprint
+static inline uint8_t key_fp(const void *key, uint32_t len)
+{
+  // fnv-1a folded to 8 bits
+  const uint8_t *ptr = (const uint8_t *)key;
+  uint32_t h = 2166136261u;
+  for (uint32_t i = 0; i < len; ++i) {
+    h ^= ptr[i];
+    h *= 16777619u;
+  }
+  return (uint8_t)(h ^ (h >> 8) ^ (h >> 16) ^ (h >> 24));
+}
+
+// return the index of key suffix `key` in leaf `n` with valid fingerprints, -1 if not found
+static int node_fp_find(node *n, const void *key, uint32_t len)
+{
+  index_t *index = node_index(n);
+  const uint8_t *fp = node_fp(n);
+  uint8_t h = key_fp(key, len);
+  uint32_t i = 0;
+#ifdef __SSE2__
+  const __m128i target = _mm_set1_epi8((char)h);
+  for (; i + 16 <= n->keys; i += 16) {
+    __m128i cur = _mm_loadu_si128((const __m128i *)(fp + i));
+    uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(cur, target));
+    while (mask) {
+      uint32_t j = i + __builtin_ctz(mask);
+      get_key_info(n, index[j], key2, len2);
+      if (compare_key(key2, len2, key, len) == 0)
+        return (int)j;
+      mask &= mask - 1;
+    }
+  }
+#endif
+  for (; i < n->keys; ++i) {
+    if (fp[i] != h) continue;
+    get_key_info(n, index[i], key2, len2);
+    if (compare_key(key2, len2, key, len) == 0)
+      return (int)i;
+  }
+  return -1;
+}
+#endif // Fingerprint
+
+// rebuild fingerprints of leaf `n` after it's reorganized, invalidate them if there is no room
+static void node_fp_build(node *n)
+{
+#ifdef Fingerprint
+  n->sopt = 0;
+  uint8_t *fp = node_fp(n);
+  if ((n->data + n->off) > (char *)fp)
+    return ;
+
+  index_t *index = node_index(n);
+  for (uint32_t i = 0; i < n->keys; ++i) {
+    get_key_info(n, index[i], key, len);
+    fp[i] = key_fp(key, len);
+  }
+  n->sopt = 1;
+#else
+  (void)n;
+#endif
+}
+
+#ifdef Fingerprint
+// make room for the fingerprint of key suffix `key` at `low` before it's inserted,
+// return 0 if there is no room for both the kv and the fingerprints
+static int node_fp_insert(node *n, uint32_t low, const void *key, uint32_t len)
+{
+  uint8_t *fp = node_fp(n), *nfp = fp - index_byte - 1;
+  if ((n->data + (n->off + key_byte + len + value_bytes)) > (char *)nfp)
+    return 0;
+
+  memmove(nfp, fp, low);
+  memmove(nfp + low + 1, fp + low, n->keys - low);
+  nfp[low] = key_fp(key, len);
+  return 1;
+}
+#endif // Fingerprint
+
+/****** HEAD operation ******/
+
+// branch can keep a 4 byte head of each separator right below its index, head is taken after
+// the common prefix of all the separators, so that descend compares integers instead of chasing
+// keys all over the node, full keys are only compared when heads are equal,
+// heads are laid out as a static 16-ary search tree with each block in one cache line,
+// level 0 has all the heads in index order, entry `j` of level `l` is the last head of
+// block `j` in level `l - 1`, the top level has no more than 16 entries,
+// sopt is 0 if heads are invalid, else it's the head offset plus 1
+
+#define head_fanout     16
+#define head_max_levels 5
+#define head_max_offset 254
+#define cache_line_mask (~(uintptr_t)63)
+
+typedef struct head_layout
+{
+  uint32_t  levels;
+  uint32_t  count[head_max_levels];
+  uint32_t *base[head_max_levels];
+}head_layout;
+
+#ifdef Heads
+static inline uint32_t key_head(const void *key, uint32_t len, uint32_t off)
+{
+  // missing bytes are 0, so that head order never conflicts with key order
+  const uint8_t *ptr = (const uint8_t *)key;
+  uint32_t h = 0;
+  for (uint32_t i = off; i < off + 4; ++i)
+    h = (h << 8) | (i < len ? ptr[i] : 0);
+  return h;
+}
+
+// get the head layout of branch `n` as if it had `keys` keys,
+// return the lowest address it uses
+static char* node_head_layout(node *n, uint32_t keys, head_layout *hl)
+{
+  uintptr_t ptr = (uintptr_t)((char *)n + (node_bytes(n) - (keys * index_byte)));
+  uint32_t count = keys;
+  hl->levels = 0;
+  do {
+    ptr = (ptr - count * sizeof(uint32_t)) & cache_line_mask;
+    hl->count[hl->levels] = count;
+    hl->base[hl->levels] = (uint32_t *)ptr;
+    ++hl->levels;
+    count = (count + head_fanout - 1) / head_fanout;
+  } while (hl->count[hl->levels - 1] > head_fanout);
+  assert(hl->levels <= head_max_levels);
+  return (char *)ptr;
+}
+
+// fill every level above level 0
+static void node_head_fill(head_layout *hl)
+{
+  for (uint32_t l = 1; l < hl->levels; ++l) {
+    uint32_t *cur = hl->base[l], *low = hl->base[l - 1], last = hl->count[l - 1] - 1;
+    for (uint32_t j = 0; j < hl->count[l]; ++j) {
+      uint32_t k = j * head_fanout + head_fanout - 1;
+      cur[j] = low[k < last ? k : last];
+    }
+  }
+}
+
+// return the index of the first head that is not less than `h`
+static uint32_t node_head_lower_bound(const head_layout *hl, uint32_t h)
+{
+  uint32_t blk = 0;
+  for (int l = (int)hl->levels - 1; l >= 0; --l) {
+    const uint32_t *cur = hl->base[l];
+    uint32_t beg = blk * head_fanout, end = beg + head_fanout;
+    if (end > hl->count[l]) end = hl->count[l];
+    // heads are sorted, count them instead of searching, so that there is no branch miss
+    uint32_t i = beg;
+    for (uint32_t k = beg; k < end; ++k)
+      i += cur[k] < h;
+    if (i == end) // only happens in top level
+      return hl->count[0];
+    blk = i;
+  }
+  return blk;
+}
+
+// return how many keys in branch `n` with valid heads are not greater than `key`
+static uint32_t node_head_upper_bound(node *n, const void *key, uint32_t len)
+{
+  if (n->keys == 0) return 0;
+
+  index_t *index = node_index(n);
+  uint32_t off = n->sopt - 1;
+  if (off) { // compare with common prefix of all the separators
+    get_key_info(n, index[0], fkey, flen);
+    (void)flen;
+    int r = compare_key(key, len < off ? len : off, fkey, off);
+    if (r) return r < 0 ? 0 : n->keys;
+  }
+
+  head_layout hl;
+  node_head_layout(n, n->keys, &hl);
+  uint32_t h = key_head(key, len, off);
+  uint32_t first = node_head_lower_bound(&hl, h);
+  uint32_t last  = h == UINT32_MAX ? n->keys : node_head_lower_bound(&hl, h + 1);
+
+  // keys in [first, last) have the same head as `key`
+  while (first < last) {
+    uint32_t mid = (first + last) / 2;
+    get_key_info(n, index[mid], key1, len1);
+    if (compare_key(key1, len1, key, len) <= 0)
+      first = mid + 1;
+    else
+      last = mid;
+  }
+  return first;
+}
+#endif // Heads
+
+// rebuild heads of branch `n` after it's reorganized, invalidate them if there is no room
+static void node_head_build(node *n)
+{
+#ifdef Heads
+  n->sopt = 0;
+  index_t *index = node_index(n);
+
+  uint32_t off = 0;
+  if (n->keys > 1) { // separators are sorted, common prefix of the first and the last is for all
+    get_key_info(n, index[0], fkey, flen);
+    get_key_info(n, index[n->keys - 1], lkey, llen);
+    const char *f = (const char *)fkey, *l = (const char *)lkey;
+    while (off < flen && off < llen && off < head_max_offset && f[off] == l[off])
+      ++off;
+  }
+
+  head_layout hl;
+  if ((n->data + n->off) > node_head_layout(n, n->keys, &hl))
+    return ;
+
+  for (uint32_t i = 0; i < n->keys; ++i) {
+    get_key_info(n, index[i], key, len);
+    hl.base[0][i] = key_head(key, len, off);
+  }
+  node_head_fill(&hl);
+  n->sopt = off + 1;
+#else
+  (void)n;
+#endif
+}
+
+#ifdef Heads
+// make room for the head of `key` at `low` before it's inserted,
+// return 0 if there is no room for both the kv and the heads or the common prefix changes
+static int node_head_insert(node *n, uint32_t low, const void *key, uint32_t len)
+{
+  uint32_t off = n->sopt - 1;
+  if (off) {
+    if (len < off) return 0;
+    index_t *index = node_index(n);
+    get_key_info(n, index[0], fkey, flen);
+    (void)flen;
+    if (memcmp(key, fkey, off)) return 0;
+  } else if (n->keys == 1) {
+    // common prefix is not computed for single key, it may be longer than 0 now
+    return 0;
+  }
+
+  head_layout ol, nl;
+  node_head_layout(n, n->keys, &ol);
+  if ((n->data + (n->off + key_byte + len + value_bytes)) > node_head_layout(n, n->keys + 1, &nl))
+    return 0;
+
+  // level 0 never moves up, move the part before `low` first if it moves down
+  uint32_t *o = ol.base[0], *p = nl.base[0];
+  if (p != o) memmove(p, o, low * sizeof(uint32_t));
+  memmove(p + low + 1, o + low, (n->keys - low) * sizeof(uint32_t));
+  p[low] = key_head(key, len, off);
+  node_head_fill(&nl);
+  return 1;
+}
+#endif // Heads
+
+// rebuild fingerprints or heads after node `n` is reorganized
+static void node_search_build(node *n)
+{
+  if (unlikely(n->type & Batch)) return ;
+  if (n->level)
+    node_head_build(n);
+  else
+    node_fp_build(n);
+}
+
+#if defined(Fingerprint) || defined(Heads)
+// update valid fingerprints or heads for `key` that is about to be inserted at `low`,
+// return 0 if they can not be updated in place
+static int node_search_insert(node *n, uint32_t low, const void *key, uint32_t len)
+{
+#ifdef Heads
+  if (n->level)
+    return node_head_insert(n, low, key, len);
+#endif
+#ifdef Fingerprint
+  if (n->level == 0)
+    return node_fp_insert(n, low, key, len);
+#endif
+  return 0;
+}
+#endif
+
+#endif // FixedKey
+
 /****** NODE operation ******/
 
 node* new_node(uint8_t type, uint8_t level)
 {
-  uint32_t size = likely(type < Batch) ? node_size : batch_size;
+  return new_node_with_size(type, level, likely(type < Batch) ? node_size : batch_size);
+}
+
+// `size` must be one of the sizes returned by `get_level_node_size`
+node* new_node_with_size(uint8_t type, uint8_t level, uint32_t size)
+{
+  assert(size >= branch_min_size && size <= node_max_size && (size & ~node_kb_mask) == 0);
 #ifdef Allocator
   node *n = (node *)allocator_alloc(size);
 #else
@@ -86,10 +404,17 @@ node* new_node(uint8_t type, uint8_t level)
 #endif
 
   node_init(n, type, level);
+  n->size = size >> 10;
 
   return n;
 }
 
+// size of `n` in bytes, new node in the same level should have the same size
+inline uint32_t node_get_size(node *n)
+{
+  return ((uint32_t)n->size) << 10;
+}
+
 inline void node_init(node *n, uint8_t type, uint8_t level)
 {
   n->type  = type;
@@ -101,6 +426,7 @@ inline void node_init(node *n, uint8_t type, uint8_t level)
     n->id = __atomic_fetch_add(&node_id, 1, __ATOMIC_RELAXED);
   else
     n->id = 0;
+  n->size  = (likely((type & Batch) == 0) ? node_size : batch_size) >> 10;
   n->keys  = 0;
   n->off   = 0;
   n->next  = 0;
@@ -124,6 +450,23 @@ void node_prefetch(node *n)
   __builtin_prefetch(n, 0 /* rw */, 3 /* locality */);
 }
 
+static void node_insert_kv(node *n, const void *key, uint32_t len, const void *val)
+{
+  *((len_t *)(n->data + n->off)) = (len_t)len;
+  n->off += key_byte;
+  memcpy(n->data + n->off, key, len);
+  n->off += len;
+  if (likely(val))
+    *((val_t *)(n->data + n->off)) = *(val_t *)(&val);
+  else
+    *((val_t *)(n->data + n->off)) = 0;
+  n->off += value_bytes;
+
+  ++n->keys;
+}
+
+#ifndef FixedKey
+
 // DFS free each node
 void free_btree_node(node *n)
 {
@@ -134,7 +477,6 @@ void free_btree_node(node *n)
 
   if (n->level) {
     free_btree_node(n->first);
-    assert(n->keys);
     index_t *index = node_index(n);
     for (uint32_t i = 0; i < n->keys; ++i) {
       node *child = (node *)get_val(n, index[i]);
@@ -185,9 +527,25 @@ int node_not_include_key(node *n, const void *key, uint32_t len)
 
 node* node_descend(node *n, const void *key, uint32_t len)
 {
-  assert(n->level && n->keys && n->pre == 0);
+  // branch node can have no key but the first child after deletion
+  assert(n->level);
   index_t *index = node_index(n);
 
+  if (n->pre) { // key without node prefix is less or greater than all the separators
+    int r = compare_key(key, len < n->pre ? len : n->pre, n->data, n->pre);
+    if (unlikely(r))
+      return r < 0 ? n->first : (node *)get_val(n, index[n->keys - 1]);
+    key = (const char *)key + n->pre;
+    len -= n->pre;
+  }
+
+#ifdef Heads
+  if (n->sopt) {
+    uint32_t first = node_head_upper_bound(n, key, len);
+    return likely(first) ? (node *)get_val(n, index[first - 1]) : n->first;
+  }
+#endif
+
   int first = 0, count = (int)n->keys;
 
   while (count > 0) {
@@ -206,6 +564,67 @@ node* node_descend(node *n, const void *key, uint32_t len)
   return likely(first) ? (node *)get_val(n, index[first - 1]) : n->first;
 }
 
+// return how many leading bytes of `pre` all the separators in branch node `n` have, since
+// separators are sorted, it's enough to check the first one and the last one
+uint32_t node_descend_skip(node *n, const void *pre, uint32_t plen)
+{
+  assert(n->level);
+  if (n->keys == 0) return 0;
+
+  // node prefix is shared by all the separators
+  const char *p = (const char *)pre;
+  uint32_t i = 0;
+  for (; i < n->pre && i < plen && n->data[i] == p[i]; ++i) ;
+  if (i < n->pre) return i;
+  p += n->pre;
+  plen -= n->pre;
+
+  index_t *index = node_index(n);
+  get_key_info(n, index[0], fkey, flen);
+  get_key_info(n, index[n->keys - 1], lkey, llen);
+  if (flen < plen) plen = flen;
+  if (llen < plen) plen = llen;
+
+  const char *f = (const char *)fkey, *l = (const char *)lkey;
+  i = 0;
+  for (; i < plen && f[i] == p[i] && l[i] == p[i]; ++i) ;
+  return i + n->pre;
+}
+
+// same as `node_descend`, but the first `skip` bytes of key are known to be the same as those of
+// every separator in `n` (see `node_descend_skip`), so only the bytes after them are compared
+node* node_descend_from(node *n, const void *key, uint32_t len, uint32_t skip)
+{
+#ifdef Heads
+  if (n->sopt) return node_descend(n, key, len);
+#endif
+  if (skip <= n->pre) return node_descend(n, key, len);
+
+  assert(n->level && len >= skip);
+  index_t *index = node_index(n);
+
+  const void *key1 = (const char *)key + skip;
+  uint32_t    len1 = len - skip;
+  skip -= n->pre; // separators are stored without node prefix
+
+  int first = 0, count = (int)n->keys;
+
+  while (count > 0) {
+    int half = count >> 1;
+    int middle = first + half;
+
+    get_key_info(n, index[middle], key2, len2);
+
+    if (compare_key((const char *)key2 + skip, len2 - skip, key1, len1) <= 0) {
+      first = middle + 1;
+      count -= half + 1;
+    } else {
+      count = half;
+    }
+  }
+  return likely(first) ? (node *)get_val(n, index[first - 1]) : n->first;
+}
+
 // find the key in the leaf, return its pointer, if no such key, return 0
 // if this is a blink node and we need to move right, return -1
 void* node_search(node *n, const void *key, uint32_t len)
@@ -222,8 +641,22 @@ void* node_search(node *n, const void *key, uint32_t len)
   const void *key1 = (char *)key + n->pre;
   uint32_t    len1 = len - n->pre;
 
-  int low = 0, high = (int)n->keys - 1;
   index_t *index = node_index(n);
+#ifdef Fingerprint
+  if (n->sopt) {
+    int i = node_fp_find(n, key1, len1);
+    if (i >= 0)
+      return get_val(n, index[i]);
+    if (unlikely(n->type & Blink) && n->keys) {
+      get_key_info(n, index[n->keys - 1], lkey, llen);
+      if (compare_key(lkey, llen, key1, len1) < 0)
+        return (void *)-1;
+    }
+    return (void *)0;
+  }
+#endif
+
+  int low = 0, high = (int)n->keys - 1;
   while (low <= high) {
     int mid = (low + high) / 2;
 
@@ -245,12 +678,84 @@ void* node_search(node *n, const void *key, uint32_t len)
   return (void *)0;
 }
 
+// find the key in the leaf, return the pointer to its value, if no such key, return 0
+val_t* node_search_value_ptr(node *n, const void *key, uint32_t len)
+{
+  assert(n->level == 0);
+
+  if (n->pre) {
+    if (len <= n->pre || compare_key(n->data, n->pre, key, n->pre)) // compare with node prefix
+      return 0;
+  }
+
+  const void *key1 = (char *)key + n->pre;
+  uint32_t    len1 = len - n->pre;
+
+  index_t *index = node_index(n);
+#ifdef Fingerprint
+  if (n->sopt) {
+    int i = node_fp_find(n, key1, len1);
+    if (i < 0) return 0;
+    get_key_info(n, index[i], key2, len2);
+    return (val_t *)((char *)key2 + len2);
+  }
+#endif
+
+  int low = 0, high = (int)n->keys - 1;
+  while (low <= high) {
+    int mid = (low + high) / 2;
+
+    get_key_info(n, index[mid], key2, len2);
+
+    int r = compare_key(key2, len2, key1, len1);
+    if (r == 0) {
+      return (val_t *)((char *)key2 + len2);
+    } else if (r < 0) {
+      low  = mid + 1;
+    } else {
+      high = mid - 1;
+    }
+  }
+
+  return 0;
+}
+
+// move the first `prelen` bytes of every key in `n` to node prefix, `key` has these bytes as well
+static void node_extend_prefix(node *n, const void *key, uint32_t prelen)
+{
+  // copy new node content to `buf`, adjust node index at the same time
+  index_t *index = node_index(n);
+  char buf[node_bytes(n)];
+  uint32_t off = 0;
+  memcpy(buf, n->data, n->pre);
+  off += n->pre;
+  memcpy(buf + off, key, prelen);
+  off += prelen;
+  for (uint32_t i = 0; i < n->keys; ++i) {
+    get_key_info(n, index[i], k, l);
+    index[i] = off;
+    uint32_t nl = l - prelen;
+    *((len_t *)(buf + off)) = (len_t)nl;
+    off += key_byte;
+    memcpy(buf + off, k + prelen, nl + value_bytes);
+    off += nl + value_bytes;
+  }
+
+  // copy new node content back
+  memcpy(n->data, buf, off);
+  // assign new offset
+  n->off = off;
+  // assign new prefix length
+  n->pre += prelen;
+}
+
 // if we can do a prefix compression and fit the new key in this node, return 1; else return 0
 // note: this is a little bit time consuming
 static int node_try_prefix_compression(node *n, const void *key, uint32_t len)
 {
 #ifdef Prefix
-  // prefix compression is only supported in level 0
+  // separators inserted later may not have the prefix of current ones,
+  // so branch node is compressed by `node_compress_branch` instead
   if (n->level)
     return 0;
 
@@ -283,29 +788,7 @@ static int node_try_prefix_compression(node *n, const void *key, uint32_t len)
   if ((n->data + new_off) > (char *)index)
     return 0;
 
-  // copy new node content to `buf`, adjust node index at the same time
-  char buf[node_size];
-  uint32_t off = 0;
-  memcpy(buf, n->data, n->pre);
-  off += n->pre;
-  memcpy(buf + off, key, prelen);
-  off += prelen;
-  for (uint32_t i = 0; i < n->keys; ++i) {
-    get_key_info(n, index[i], k, l);
-    index[i] = off;
-    uint32_t nl = l - prelen;
-    *((len_t *)(buf + off)) = (len_t)nl;
-    off += key_byte;
-    memcpy(buf + off, k + prelen, nl + value_bytes);
-    off += nl + value_bytes;
-  }
-
-  // copy new node content back
-  memcpy(n->data, buf, off);
-  // assign new offset
-  n->off = off;
-  // assign new prefix length
-  n->pre += prelen;
+  node_extend_prefix(n, key, prelen);
   return 1;
 #else
   (void)n;
@@ -315,19 +798,30 @@ static int node_try_prefix_compression(node *n, const void *key, uint32_t len)
 #endif
 }
 
-static void node_insert_kv(node *n, const void *key, uint32_t len, const void *val)
+// move the common prefix of all the separators in branch `n` to node prefix, but no more than
+// `max` bytes of whole key, which every key that falls into `n` has (see `node_child_prefix`),
+// so that no separator inserted later conflicts with it,
+// return 1 if node prefix is extended, else return 0
+int node_compress_branch(node *n, uint32_t max)
 {
-  *((len_t *)(n->data + n->off)) = (len_t)len;
-  n->off += key_byte;
-  memcpy(n->data + n->off, key, len);
-  n->off += len;
-  if (likely(val))
-    *((val_t *)(n->data + n->off)) = *(val_t *)(&val);
-  else
-    *((val_t *)(n->data + n->off)) = 0;
-  n->off += value_bytes;
+  assert(n->level && (n->type & Blink) == 0);
+  if (n->keys == 0 || max <= n->pre) return 0;
+  max -= n->pre;
 
-  ++n->keys;
+  // separators are sorted, common prefix of the first and the last is for all,
+  // each of them keeps at least one byte
+  index_t *index = node_index(n);
+  get_key_info(n, index[0], fkey, flen);
+  get_key_info(n, index[n->keys - 1], lkey, llen);
+  const char *f = (const char *)fkey, *l = (const char *)lkey;
+  uint32_t prelen = 0;
+  while (prelen < max && prelen + 1 < flen && prelen + 1 < llen && f[prelen] == l[prelen])
+    ++prelen;
+  if (prelen == 0) return 0;
+
+  node_extend_prefix(n, fkey, prelen);
+  node_search_build(n);
+  return 1;
 }
 
 // insert a kv into node:
@@ -339,7 +833,6 @@ static void node_insert_kv(node *n, const void *key, uint32_t len, const void *v
 int node_insert(node *n, const void *key, uint32_t len, const void *val)
 {
   if (n->pre) { // compare with node prefix
-    assert(n->level == 0);
     // TODO: remove this if we can handle key length <= prefix length
     assert(len > n->pre);
     if (compare_key(n->data, n->pre, key, n->pre))
@@ -372,14 +865,22 @@ int node_insert(node *n, const void *key, uint32_t len, const void *val)
     return -3;
 
   // check if there is enough space
+  int rebuild = 0;
   if (unlikely((n->data + (n->off + key_byte + len1 + value_bytes + index_byte)) > (char *)index)) {
     if (!node_try_prefix_compression(n, key1, len1)) return -1;
     // need to update new key suffix
     key1 = (char *)key + n->pre;
     len1 = len - n->pre;
     assert((n->data + (n->off + key_byte + len1 + value_bytes + index_byte)) <= (char *)index);
+    rebuild = 1;
   }
 
+#if defined(Fingerprint) || defined(Heads)
+  // fingerprints or heads are moved before index and kv are written, they may overlap
+  if (n->sopt == 0 || rebuild || !node_search_insert(n, low, key1, len1))
+    rebuild = 1;
+#endif
+
   // update index
   --index;
   if (likely(low)) memmove(&index[0], &index[1], low * index_byte);
@@ -387,18 +888,52 @@ int node_insert(node *n, const void *key, uint32_t len, const void *val)
 
   node_insert_kv(n, key1, len1, val);
 
+  if (rebuild)
+    node_search_build(n);
+
   return 1;
 }
 
+#ifndef BStar
+// Reference: Prefix B-Trees
+// find the split point of leaf `n` within `window` keys around the middle, where the separator,
+// common prefix of the two keys around it plus one byte, is the shortest
+static uint32_t node_split_point(node *n, uint32_t window)
+{
+  uint32_t mid = n->keys / 2, best = mid, min = max_key_size;
+  assert(window < mid);
+  index_t *index = node_index(n);
+  // start from the middle so that a balanced split wins a tie
+  for (uint32_t d = 0; d <= window * 2; ++d) {
+    uint32_t i = (d & 1) ? mid + (d + 1) / 2 : mid - d / 2;
+    get_key_info(n, index[i - 1], lkey, llen);
+    get_key_info(n, index[i], rkey, rlen);
+    const char *lk = (const char *)lkey, *rk = (const char *)rkey;
+    uint32_t j = 0;
+    for (; j < llen && j < rlen && j < min && lk[j] == rk[j]; ++j) ;
+    if (j < min) {
+      min  = j;
+      best = i;
+    }
+  }
+  return best;
+}
+#endif // BStar
+
 // split half of the node entries from `old` to `new`
 void node_split(node *old, node *new, char *pkey, uint32_t *plen)
 {
-  uint32_t left = old->keys / 2, right = old->keys - left;
+  uint32_t left = old->keys / 2;
+#ifndef BStar
+  // separator of leaf node is truncated, so we look for a short one around the middle
+  if (likely(old->level == 0) && (old->type & Blink) == 0 && old->keys >= 32)
+    left = node_split_point(old, old->keys >> 4);
+#endif
+  uint32_t right = old->keys - left;
   index_t *l_idx = node_index(old), *r_idx = node_index(new);
   *plen = 0;
 
   if (old->pre) { // copy prefix
-    assert(old->level == 0);
     memcpy(new->data, old->data, old->pre);
     new->pre = old->pre;
     new->off = new->pre;
@@ -467,6 +1002,9 @@ void node_split(node *old, node *new, char *pkey, uint32_t *plen)
   new->off -= length;
   memmove(new->data + new->pre, new->data + new->pre + length, new->off - new->pre);
 
+  node_search_build(old);
+  node_search_build(new);
+
   // update node link
   new->next = old->next;
   old->next = new;
@@ -501,10 +1039,8 @@ static inline void node_get_whole_key(node *n, uint32_t idx, char *key, uint32_t
   assert(idx < n->keys);
   index_t *index = node_index(n);
   get_key_info(n, index[idx], buf, buf_len);
-  if (n->pre) {
-    assert(n->level == 0);
+  if (n->pre)
     memcpy(key, n->data, n->pre);
-  }
   memcpy(key + n->pre, buf, buf_len);
   *len = buf_len + n->pre;
 }
@@ -513,6 +1049,8 @@ inline int node_is_after_key(node *n, const void *key, uint32_t len)
 {
   assert(n->level == 0);
 
+  if (n->keys == 0) return 0;
+
   char     first[max_key_size];
   uint32_t flen;
   node_get_whole_key(n, 0, first, &flen);
@@ -528,12 +1066,70 @@ inline int node_need_move_right(node *n, const void *key, uint32_t len)
   return compare_key(last, llen, key, len) < 0;
 }
 
+// compare the whole key at `idx` (prefix included) with `key`
+static int node_compare_key_at(node *n, uint32_t idx, const void *key, uint32_t len)
+{
+  if (n->pre) {
+    uint32_t min = n->pre < len ? n->pre : len;
+    int r = memcmp(n->data, key, min);
+    if (r) return r;
+    // whole key is always longer than prefix
+    if (len <= n->pre) return +1;
+  }
+
+  index_t *index = node_index(n);
+  get_key_info(n, index[idx], key1, len1);
+  return compare_key(key1, len1, (char *)key + n->pre, len - n->pre);
+}
+
+// collect kv pairs in [key, s->end) of leaf node `n` into `s`, if `key` is 0, start from the first key,
+// return 1 if the scan should go on in next node, else return 0
+int node_scan(node *n, const void *key, uint32_t len, scan *s)
+{
+  assert(n->level == 0);
+
+  uint32_t i = 0;
+  if (key) { // find the first key that is not less than `key`
+    int low = 0, high = (int)n->keys - 1;
+    while (low <= high) {
+      int mid = (low + high) / 2;
+      if (node_compare_key_at(n, mid, key, len) < 0)
+        low  = mid + 1;
+      else
+        high = mid - 1;
+    }
+    i = low;
+  }
+
+  index_t *index = node_index(n);
+  for (; i < n->keys; ++i) {
+    if (s->limit && s->keys == s->limit)
+      return 0;
+    if (s->end && node_compare_key_at(n, i, s->end, s->elen) >= 0)
+      return 0;
+
+    get_key_info(n, index[i], key1, len1);
+    uint32_t whole = n->pre + len1;
+    if (s->off + key_byte + whole + value_bytes > s->size)
+      return 0;
+
+    char *ptr = s->buf + s->off;
+    *((len_t *)ptr) = (len_t)whole;
+    ptr += key_byte;
+    memcpy(ptr, n->data, n->pre);
+    memcpy(ptr + n->pre, key1, len1 + value_bytes); // value is right after the key
+    s->off += key_byte + whole + value_bytes;
+    ++s->keys;
+  }
+  return 1;
+}
+
 // delete key in range [from, to), pain in the ass, it's really expensive
 static void node_delete_range(node *n, uint32_t from, uint32_t to)
 {
   assert(from < to && to <= n->keys);
-  char buf[node_size - node_offset];
-  memcpy(buf, (const void *)n, node_size - node_offset);
+  char buf[node_bytes(n)];
+  memcpy(buf, (const void *)n, node_bytes(n));
   node *o = (node *)buf;
   index_t *o_idx = node_index(o);
 
@@ -554,6 +1150,175 @@ static void node_delete_range(node *n, uint32_t from, uint32_t to)
     get_kv_info(o, o_idx[i], k, l, v);
     node_insert_kv(n, k, l, (const void *)v);
   }
+
+  node_search_build(n);
+}
+
+// delete key in node and store its value in `val` if `val` is not 0,
+// if key does not exist, return 0, if succeed, return 1
+int node_delete(node *n, const void *key, uint32_t len, void **val)
+{
+  if (n->pre) { // compare with node prefix
+    if (len <= n->pre || compare_key(n->data, n->pre, key, n->pre))
+      return 0;
+  }
+
+  const void *key1 = (char *)key + n->pre;
+  uint32_t    len1 = len - n->pre;
+
+  int low = 0, high = (int)n->keys - 1;
+  index_t *index = node_index(n);
+  while (low <= high) {
+    int mid = (low + high) / 2;
+
+    get_key_info(n, index[mid], key2, len2);
+
+    int r = compare_key(key2, len2, key1, len1);
+    if (r == 0) {
+      if (val) *val = get_val(n, index[mid]);
+      node_delete_range(n, mid, mid + 1);
+      // empty node has no prefix
+      if (n->keys == 0) {
+        n->pre = 0;
+        n->off = 0;
+      }
+      return 1;
+    } else if (r < 0) {
+      low  = mid + 1;
+    } else {
+      high = mid - 1;
+    }
+  }
+
+  return 0;
+}
+
+// get the fence key of `child` in branch node `n`,
+// return 0 if `child` is the first child or `child` is not in `n`, else return 1
+int node_get_child_key(node *n, node *child, char *key, uint32_t *len)
+{
+  assert(n->level);
+
+  index_t *index = node_index(n);
+  for (uint32_t i = 0; i < n->keys; ++i) {
+    get_kv_info(n, index[i], key1, len1, val1);
+    (void)key1, (void)len1;
+    if ((node *)val1 == child) {
+      node_get_whole_key(n, i, key, len);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// return how many leading bytes all the keys that fall into `child` of branch `n` have in common,
+// that is the common prefix of the two fence keys around `child`, for the first and the last child
+// only the prefix of `n` is known, return 0 if `child` is not in `n`
+uint32_t node_child_prefix(node *n, node *child)
+{
+  assert(n->level);
+  if (n->first == child) return n->pre;
+
+  index_t *index = node_index(n);
+  for (uint32_t i = 0; i < n->keys; ++i) {
+    get_kv_info(n, index[i], key1, len1, val1);
+    if ((node *)val1 != child) continue;
+    if (i + 1 == n->keys) return n->pre;
+
+    get_key_info(n, index[i + 1], key2, len2);
+    const char *k1 = (const char *)key1, *k2 = (const char *)key2;
+    uint32_t j = 0;
+    for (; j < len1 && j < len2 && k1[j] == k2[j]; ++j) ;
+    return n->pre + j;
+  }
+  return 0;
+}
+
+// node is underfull if it uses less than 1/4 of the space
+inline int node_is_underfull(node *n)
+{
+  return (n->off + n->keys * index_byte) < ((node_bytes(n) - sizeof(node)) >> 2);
+}
+
+// append all the kv pairs in `src` to `n`, the part of `src` prefix that `n` does not have
+// is put back to each key
+static void node_append_kv(node *n, index_t *idx, node *src)
+{
+  index_t *s_idx = node_index(src);
+  uint32_t extra = src->pre - n->pre;
+  for (uint32_t i = 0; i < src->keys; ++i) {
+    get_key_info(src, s_idx[i], k, l);
+    idx[n->keys] = n->off;
+    *((len_t *)(n->data + n->off)) = (len_t)(extra + l);
+    n->off += key_byte;
+    memcpy(n->data + n->off, src->data + n->pre, extra);
+    n->off += extra;
+    memcpy(n->data + n->off, k, l + value_bytes); // value is right after the key
+    n->off += l + value_bytes;
+    ++n->keys;
+  }
+}
+
+// move all the kv pairs in `right` to `left` and unlink `right`, `key` is the fence key of `right`
+// in parent, it is only used for branch node, where it becomes the fence key of `right->first`,
+// to avoid splitting merged node soon, merged node can take up at most 3/4 of the space,
+// return 1 if succeed, else return 0
+int node_merge(node *left, node *right, const void *key, uint32_t len)
+{
+  assert(left->level == right->level && left->next == right);
+
+  // merged node keeps the common prefix of both nodes
+  uint32_t pre;
+  if (left->keys == 0) {
+    pre = right->pre;
+  } else if (right->keys == 0) {
+    pre = left->pre;
+  } else {
+    uint32_t min = left->pre < right->pre ? left->pre : right->pre;
+    for (pre = 0; pre < min && left->data[pre] == right->data[pre]; ++pre) ;
+  }
+
+  if (left->level && pre) { // fence key of `right` is stored without prefix as well
+    const char *k = (const char *)key, *p = left->keys ? left->data : right->data;
+    uint32_t i = 0;
+    for (; i < pre && i + 1 < len && k[i] == p[i]; ++i) ;
+    pre = i;
+  }
+
+  uint32_t keys = left->keys + right->keys;
+  uint32_t need = pre + (left->off - left->pre) + (right->off - right->pre);
+  if (left->keys)  need += left->keys * (left->pre - pre);
+  if (right->keys) need += right->keys * (right->pre - pre);
+  if (left->level) {
+    ++keys;
+    need += key_byte + len + value_bytes;
+  }
+  need += keys * index_byte;
+  if (need > (((node_bytes(left) - sizeof(node)) * 3) >> 2))
+    return 0;
+
+  char buf[node_bytes(left)];
+  memcpy(buf, (const void *)left, node_bytes(left));
+  node *o = (node *)buf;
+
+  if (left->keys == 0)
+    memcpy(left->data, right->data, pre);
+  left->pre  = pre;
+  left->keys = keys; // set `keys` field to get right index
+  index_t *idx = node_index(left);
+  left->keys = 0;
+  left->off  = pre;
+
+  node_append_kv(left, idx, o);
+  if (left->level) {
+    idx[left->keys] = left->off;
+    node_insert_kv(left, (const char *)key + pre, len - pre, (const void *)right->first);
+  }
+  node_append_kv(left, idx, right);
+  node_search_build(left);
+
+  left->next = right->next;
+  return 1;
 }
 
 // try to move some key from `left` to `right`, keeping their balance at the same time,
@@ -602,9 +1367,510 @@ int node_adjust_few(node *left, node *right, char *okey, uint32_t *olen, char *k
     r_idx[0] = right->off;
     node_insert_kv(right, k, l, (const void *)v);
   }
+  node_search_build(right);
+
+  // step 2, deal with the hole caused by this move
+  node_delete_range(left, left->keys - moved_key, left->keys);
+
+  // record new fence key
+  node_get_whole_key(right, 0, key, len);
+
+  return moved_key;
+}
+
+// move 1/3 from `left` and 1/3 from `right` to `new`, it is assured by `node_adjust_few`
+// that `left` and `right` have the same prefix, `okey` and `key` are old fence key and replace
+// fence key, `nkey` is new fence key
+void node_adjust_many(node *new, node *left, node *right, char *okey, uint32_t *olen,
+  char *key, uint32_t *len, char *nkey, uint32_t *nlen)
+{
+  // int cpl = 0; // common prefix length
+  // uint32_t l_p = left->pre, r_p = right->pre;
+  // for (uint32_t i = 0; i < l_p && i < r_p; ++i) {
+  //   if (left->data[i] != right->data[i])
+  //     break;
+  //   ++cpl;
+  // }
+
+  // record old fence key
+  node_get_whole_key(right, 0, okey, olen);
+
+  // step 1, copy prefix
+  new->pre = left->pre;
+  memcpy(new->data, left->data, new->pre);
+  new->off = new->pre;
+
+  uint32_t lmk = left->keys / 3, rmk = right->keys / 3;
+  // get new node's index
+  new->keys = lmk + rmk;
+  index_t *n_idx = node_index(new);
+  new->keys = 0;
+
+  // WARN: we assume that `new` has enough space
+
+  // step 2, move keys from `left` to `new`
+  index_t *l_idx = node_index(left);
+  uint32_t lk = left->keys;
+  for (uint32_t i = lk - lmk; i < lk; ++i) {
+    get_kv_info(left, l_idx[i], k, l, v);
+    n_idx[new->keys] = new->off;
+    node_insert_kv(new, k, l, (const void *)v);
+  }
+  // deal with the hole caused by this move
+  node_delete_range(left, lk - lmk, lk);
+
+  // step 3, move keys from `right` to `new`
+  index_t *r_idx = node_index(right);
+  for (uint32_t i = 0; i < rmk; ++i) {
+    get_kv_info(right, r_idx[i], k, l, v);
+    n_idx[new->keys] = new->off;
+    node_insert_kv(new, k, l, (const void *)v);
+  }
+  // deal with the hole caused by this move
+  node_delete_range(right, 0, rmk);
+  node_search_build(new);
+
+  // record replace fence key
+  node_get_whole_key(right, 0, key, len);
+
+  // record new fence key
+  node_get_whole_key(new, 0, nkey, nlen);
+
+  left->next = new;
+  new->next  = right;
+}
+
+// replace old key with new key, if old key and new key have the same key length, this is just an in-place update,
+// but if they don't, pain in the ass
+int node_replace_key(node *n, const void *okey, uint32_t olen, const void *val,
+  const void *key, uint32_t len)
+{
+  assert(n->level && n->keys);
+
+  if (n->pre) { // old key is in this node, so it has node prefix
+    assert(olen > n->pre && compare_key(okey, n->pre, n->data, n->pre) == 0);
+    okey = (const char *)okey + n->pre;
+    olen -= n->pre;
+  }
+
+  int low = 0, high = (int)n->keys - 1;
+  index_t *index = node_index(n);
+  while (low <= high) {
+    int mid = (low + high) / 2;
+
+    get_kv_info(n, index[mid], key1, len1, val1);
+
+    int r = compare_key(key1, len1, okey, olen);
+    if (r == 0) {
+      assert(val1 == val);
+      if (olen + n->pre == len && compare_key(key, n->pre, n->data, n->pre) == 0) {
+        memcpy((void *)key1, (const char *)key + n->pre, olen);
+        node_search_build(n);
+        return 1;
+      } else {
+        node_delete_range(n, mid, mid + 1);
+        int r = node_insert(n, key, len, val);
+        return r;
+      }
+    } else if (r < 0) {
+      low  = mid + 1;
+    } else {
+      high = mid - 1;
+    }
+  }
+
+  return 2;
+}
+
+#else // FixedKey
+
+/**
+ *   fixed key node, keys are kept as integers in a sorted array at the beginning of `data`,
+ *   values are kept in another array right after it, both of them have `fixed_capacity` slots,
+ *   key bytes are read in big endian so that integer order is the same as `compare_key` order,
+ *   `pre` and `off` are always 0, separators are always whole keys
+**/
+
+#define fixed_capacity(n) ((uint32_t)((node_bytes(n) - sizeof(node)) / (fixed_key_size + value_bytes)))
+#define fixed_keys(n)    ((uint64_t *)(n)->data)
+#define fixed_vals(n)    ((val_t *)(n)->data + fixed_capacity(n))
+
+static inline uint64_t fixed_key_to_int(const void *key)
+{
+  uint64_t k;
+  memcpy(&k, key, fixed_key_size);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  k = __builtin_bswap64(k);
+#endif
+  return k;
+}
+
+static inline void fixed_int_to_key(uint64_t k, char *key)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  k = __builtin_bswap64(k);
+#endif
+  memcpy(key, &k, fixed_key_size);
+}
+
+// return how many keys are less than `k`, or not greater than `k` if `inclusive`,
+// range is narrowed down without branch, then the rest is counted so that it can be vectorized
+static inline uint32_t fixed_rank(const uint64_t *keys, uint32_t n, uint64_t k, int inclusive)
+{
+  uint32_t base = 0;
+  while (n > 16) {
+    uint32_t half = n / 2;
+    uint64_t cur = keys[base + half - 1];
+    base += half * (uint32_t)(inclusive ? cur <= k : cur < k);
+    n -= half;
+  }
+
+  const uint64_t *cur = keys + base;
+  for (uint32_t i = 0; i < n; ++i)
+    base += (uint32_t)(inclusive ? cur[i] <= k : cur[i] < k);
+  return base;
+}
+
+// DFS free each node
+void free_btree_node(node *n)
+{
+#ifdef Allocator
+  (void)n;
+#else
+  if (n == 0) return ;
+
+  if (n->level) {
+    free_btree_node(n->first);
+    val_t *vals = fixed_vals(n);
+    for (uint32_t i = 0; i < n->keys; ++i)
+      free_btree_node((node *)vals[i]);
+  }
+
+  free_node(n);
+#endif
+}
+
+// whether we should insert key into this node, if not, return the fence key length,
+// which is always the whole key since separators are fixed size
+int node_not_include_key(node *n, const void *key, uint32_t len)
+{
+  assert(n->level == 0 || (n->type & Blink));
+  assert(n->keys && len == fixed_key_size);
+
+  return fixed_keys(n)[n->keys - 1] < fixed_key_to_int(key) ? fixed_key_size : 0;
+}
+
+node* node_descend(node *n, const void *key, uint32_t len)
+{
+  // branch node can have no key but the first child after deletion
+  assert(n->level && len == fixed_key_size);
+
+  uint32_t first = fixed_rank(fixed_keys(n), n->keys, fixed_key_to_int(key), 1);
+  return likely(first) ? (node *)fixed_vals(n)[first - 1] : n->first;
+}
+
+// fixed keys are compared as integers, there is nothing to skip
+uint32_t node_descend_skip(node *n, const void *pre, uint32_t plen)
+{
+  (void)n, (void)pre, (void)plen;
+  return 0;
+}
+
+node* node_descend_from(node *n, const void *key, uint32_t len, uint32_t skip)
+{
+  (void)skip;
+  return node_descend(n, key, len);
+}
+
+// find the key in the leaf, return its pointer, if no such key, return 0
+// if this is a blink node and we need to move right, return -1
+void* node_search(node *n, const void *key, uint32_t len)
+{
+  assert(n->level == 0 && len == fixed_key_size);
+
+  uint64_t *keys = fixed_keys(n), k = fixed_key_to_int(key);
+  uint32_t i = fixed_rank(keys, n->keys, k, 0);
+  if (i < n->keys && keys[i] == k)
+    return (void *)fixed_vals(n)[i];
+
+  if (unlikely(i == n->keys) && i && (n->type & Blink))
+    return (void *)-1;
+
+  return (void *)0;
+}
+
+// find the key in the leaf, return the pointer to its value, if no such key, return 0
+val_t* node_search_value_ptr(node *n, const void *key, uint32_t len)
+{
+  assert(n->level == 0 && len == fixed_key_size);
+
+  uint64_t *keys = fixed_keys(n), k = fixed_key_to_int(key);
+  uint32_t i = fixed_rank(keys, n->keys, k, 0);
+  return (i < n->keys && keys[i] == k) ? &fixed_vals(n)[i] : 0;
+}
+
+// insert a kv into node:
+//   if key already exists, return 0
+//   if there is not enough space, return -1
+//   if this is a blink node and we need to move right, return -3
+//   if succeed, return 1
+int node_insert(node *n, const void *key, uint32_t len, const void *val)
+{
+  assert(len == fixed_key_size);
+
+  uint64_t *keys = fixed_keys(n), k = fixed_key_to_int(key);
+  uint32_t i = fixed_rank(keys, n->keys, k, 0);
+  if (i < n->keys && keys[i] == k)
+    return 0;
+
+  if (unlikely((i == n->keys) && i && (n->type & Blink)))
+    return -3;
+
+  if (unlikely(n->keys == fixed_capacity(n)))
+    return -1;
+
+  val_t *vals = fixed_vals(n);
+  memmove(&keys[i + 1], &keys[i], (n->keys - i) * sizeof(uint64_t));
+  memmove(&vals[i + 1], &vals[i], (n->keys - i) * value_bytes);
+  keys[i] = k;
+  vals[i] = *(val_t *)(&val);
+  ++n->keys;
+
+  return 1;
+}
+
+// split half of the node entries from `old` to `new`
+void node_split(node *old, node *new, char *pkey, uint32_t *plen)
+{
+  uint32_t left = old->keys / 2, right = old->keys - left;
+  uint64_t *o_keys = fixed_keys(old), *n_keys = fixed_keys(new);
+  val_t    *o_vals = fixed_vals(old), *n_vals = fixed_vals(new);
+
+  fixed_int_to_key(o_keys[left], pkey);
+  *plen = fixed_key_size;
+
+  uint32_t from = left;
+  if (unlikely(old->level)) { // assign first child if it's not a level 0 node
+    new->first = (node *)o_vals[left];
+    ++from;
+    --right;        // one key will be promoted to upper level
+  }
+
+  memcpy(n_keys, &o_keys[from], right * sizeof(uint64_t));
+  memcpy(n_vals, &o_vals[from], right * value_bytes);
+  new->keys = right;
+  old->keys = left;
+
+  // update node link
+  new->next = old->next;
+  old->next = new;
+}
+
+// for blink node, insert the first key of `new` as fence key for `old`
+void node_insert_fence(node *old, node *new, void *next, char *pkey, uint32_t *plen)
+{
+  // remove `blink` type to help insert fence key
+  old->type &= (~(uint8_t)Blink);
+
+  if (likely(old->level == 0)) {
+    assert(new->keys);
+    fixed_int_to_key(fixed_keys(new)[0], pkey);
+    *plen = fixed_key_size;
+  }
+  assert(node_insert(old, pkey, *plen, next) == 1);
+
+  // restore `blink` type
+  old->type |= Blink;
+
+  // overwrite the old node's `next` field
+  old->next = (node *)next;
+}
+
+static inline void node_get_whole_key(node *n, uint32_t idx, char *key, uint32_t *len)
+{
+  assert(idx < n->keys);
+  fixed_int_to_key(fixed_keys(n)[idx], key);
+  *len = fixed_key_size;
+}
+
+inline int node_is_after_key(node *n, const void *key, uint32_t len)
+{
+  assert(n->level == 0 && len == fixed_key_size);
+
+  return n->keys && fixed_key_to_int(key) < fixed_keys(n)[0];
+}
+
+// for b link tree node only
+inline int node_need_move_right(node *n, const void *key, uint32_t len)
+{
+  assert(len == fixed_key_size);
+
+  return fixed_keys(n)[n->keys - 1] < fixed_key_to_int(key);
+}
+
+// compare the whole key at `idx` with `key`, `key` can be of any length
+static int node_compare_key_at(node *n, uint32_t idx, const void *key, uint32_t len)
+{
+  char buf[fixed_key_size];
+  fixed_int_to_key(fixed_keys(n)[idx], buf);
+  return compare_key(buf, fixed_key_size, key, len);
+}
+
+// collect kv pairs in [key, s->end) of leaf node `n` into `s`, if `key` is 0, start from the first key,
+// return 1 if the scan should go on in next node, else return 0
+int node_scan(node *n, const void *key, uint32_t len, scan *s)
+{
+  assert(n->level == 0);
+
+  uint32_t i = 0;
+  if (key) { // find the first key that is not less than `key`
+    int low = 0, high = (int)n->keys - 1;
+    while (low <= high) {
+      int mid = (low + high) / 2;
+      if (node_compare_key_at(n, mid, key, len) < 0)
+        low  = mid + 1;
+      else
+        high = mid - 1;
+    }
+    i = low;
+  }
+
+  val_t *vals = fixed_vals(n);
+  for (; i < n->keys; ++i) {
+    if (s->limit && s->keys == s->limit)
+      return 0;
+    if (s->end && node_compare_key_at(n, i, s->end, s->elen) >= 0)
+      return 0;
+
+    if (s->off + key_byte + fixed_key_size + value_bytes > s->size)
+      return 0;
+
+    char *ptr = s->buf + s->off;
+    *((len_t *)ptr) = (len_t)fixed_key_size;
+    ptr += key_byte;
+    fixed_int_to_key(fixed_keys(n)[i], ptr);
+    memcpy(ptr + fixed_key_size, &vals[i], value_bytes);
+    s->off += key_byte + fixed_key_size + value_bytes;
+    ++s->keys;
+  }
+  return 1;
+}
+
+// delete key in range [from, to)
+static void node_delete_range(node *n, uint32_t from, uint32_t to)
+{
+  assert(from < to && to <= n->keys);
+  uint64_t *keys = fixed_keys(n);
+  val_t    *vals = fixed_vals(n);
+  memmove(&keys[from], &keys[to], (n->keys - to) * sizeof(uint64_t));
+  memmove(&vals[from], &vals[to], (n->keys - to) * value_bytes);
+  n->keys -= to - from;
+}
+
+// delete key in node and store its value in `val` if `val` is not 0,
+// if key does not exist, return 0, if succeed, return 1
+int node_delete(node *n, const void *key, uint32_t len, void **val)
+{
+  assert(len == fixed_key_size);
+
+  uint64_t *keys = fixed_keys(n), k = fixed_key_to_int(key);
+  uint32_t i = fixed_rank(keys, n->keys, k, 0);
+  if (i == n->keys || keys[i] != k)
+    return 0;
+
+  if (val) *val = (void *)fixed_vals(n)[i];
+  node_delete_range(n, i, i + 1);
+  return 1;
+}
+
+// get the fence key of `child` in branch node `n`,
+// return 0 if `child` is the first child or `child` is not in `n`, else return 1
+int node_get_child_key(node *n, node *child, char *key, uint32_t *len)
+{
+  assert(n->level);
+
+  val_t *vals = fixed_vals(n);
+  for (uint32_t i = 0; i < n->keys; ++i) {
+    if ((node *)vals[i] == child) {
+      node_get_whole_key(n, i, key, len);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// fixed keys have no node prefix
+uint32_t node_child_prefix(node *n, node *child)
+{
+  (void)n, (void)child;
+  return 0;
+}
+
+int node_compress_branch(node *n, uint32_t max)
+{
+  (void)n, (void)max;
+  return 0;
+}
+
+// node is underfull if it uses less than 1/4 of the slots
+inline int node_is_underfull(node *n)
+{
+  return n->keys < (fixed_capacity(n) >> 2);
+}
+
+// move all the kv pairs in `right` to `left` and unlink `right`, `key` is the fence key of `right`
+// in parent, it is only used for branch node, where it becomes the fence key of `right->first`,
+// to avoid splitting merged node soon, merged node can take up at most 3/4 of the slots,
+// return 1 if succeed, else return 0
+int node_merge(node *left, node *right, const void *key, uint32_t len)
+{
+  assert(left->level == right->level && left->next == right);
+
+  uint32_t keys = left->keys + right->keys + (left->level ? 1 : 0);
+  if (keys > ((fixed_capacity(left) * 3) >> 2))
+    return 0;
+
+  uint64_t *l_keys = fixed_keys(left);
+  val_t    *l_vals = fixed_vals(left);
+  if (left->level) {
+    assert(len == fixed_key_size);
+    l_keys[left->keys] = fixed_key_to_int(key);
+    l_vals[left->keys] = (val_t)right->first;
+    ++left->keys;
+  }
+  memcpy(&l_keys[left->keys], fixed_keys(right), right->keys * sizeof(uint64_t));
+  memcpy(&l_vals[left->keys], fixed_vals(right), right->keys * value_bytes);
+  left->keys += right->keys;
+
+  left->next = right->next;
+  return 1;
+}
+
+// try to move some key from `left` to `right`, keeping their balance at the same time,
+// return how many keys we moved
+int node_adjust_few(node *left, node *right, char *okey, uint32_t *olen, char *key, uint32_t *len)
+{
+  // half of the available slots in `right`
+  uint32_t moved_key = (fixed_capacity(right) - right->keys) / 2;
+  if (moved_key > left->keys) moved_key = left->keys;
+
+  // try to reach a balance
+  uint32_t max_keys = left->keys > right->keys ? ((left->keys - right->keys) / 2) : 32;
+  if (moved_key > max_keys) moved_key = max_keys;
+  // we don't want to move too few keys, 8 is just an experienced value
+  if (moved_key < 8) return 0;
+
+  // record old fence key
+  node_get_whole_key(right, 0, okey, olen);
 
-  // step 2, deal with the hole caused by this move
-  node_delete_range(left, left->keys - moved_key, left->keys);
+  uint64_t *l_keys = fixed_keys(left), *r_keys = fixed_keys(right);
+  val_t    *l_vals = fixed_vals(left), *r_vals = fixed_vals(right);
+  memmove(&r_keys[moved_key], r_keys, right->keys * sizeof(uint64_t));
+  memmove(&r_vals[moved_key], r_vals, right->keys * value_bytes);
+  memcpy(r_keys, &l_keys[left->keys - moved_key], moved_key * sizeof(uint64_t));
+  memcpy(r_vals, &l_vals[left->keys - moved_key], moved_key * value_bytes);
+  right->keys += moved_key;
+  left->keys  -= moved_key;
 
   // record new fence key
   node_get_whole_key(right, 0, key, len);
@@ -612,55 +1878,27 @@ int node_adjust_few(node *left, node *right, char *okey, uint32_t *olen, char *k
   return moved_key;
 }
 
-// move 1/3 from `left` and 1/3 from `right` to `new`, it is assured by `node_adjust_few`
-// that `left` and `right` have the same prefix, `okey` and `key` are old fence key and replace
-// fence key, `nkey` is new fence key
+// move 1/3 from `left` and 1/3 from `right` to `new`, `okey` and `key` are old fence key and
+// replace fence key, `nkey` is new fence key
 void node_adjust_many(node *new, node *left, node *right, char *okey, uint32_t *olen,
   char *key, uint32_t *len, char *nkey, uint32_t *nlen)
 {
-  // int cpl = 0; // common prefix length
-  // uint32_t l_p = left->pre, r_p = right->pre;
-  // for (uint32_t i = 0; i < l_p && i < r_p; ++i) {
-  //   if (left->data[i] != right->data[i])
-  //     break;
-  //   ++cpl;
-  // }
-
   // record old fence key
   node_get_whole_key(right, 0, okey, olen);
 
-  // step 1, copy prefix
-  new->pre = left->pre;
-  memcpy(new->data, left->data, new->pre);
-  new->off = new->pre;
-
   uint32_t lmk = left->keys / 3, rmk = right->keys / 3;
-  // get new node's index
-  new->keys = lmk + rmk;
-  index_t *n_idx = node_index(new);
-  new->keys = 0;
+  uint64_t *n_keys = fixed_keys(new);
+  val_t    *n_vals = fixed_vals(new);
 
-  // WARN: we assume that `new` has enough space
-
-  // step 2, move keys from `left` to `new`
-  index_t *l_idx = node_index(left);
-  uint32_t lk = left->keys;
-  for (uint32_t i = lk - lmk; i < lk; ++i) {
-    get_kv_info(left, l_idx[i], k, l, v);
-    n_idx[new->keys] = new->off;
-    node_insert_kv(new, k, l, (const void *)v);
-  }
-  // deal with the hole caused by this move
-  node_delete_range(left, lk - lmk, lk);
+  // move keys from `left` to `new`
+  memcpy(n_keys, &fixed_keys(left)[left->keys - lmk], lmk * sizeof(uint64_t));
+  memcpy(n_vals, &fixed_vals(left)[left->keys - lmk], lmk * value_bytes);
+  left->keys -= lmk;
 
-  // step 3, move keys from `right` to `new`
-  index_t *r_idx = node_index(right);
-  for (uint32_t i = 0; i < rmk; ++i) {
-    get_kv_info(right, r_idx[i], k, l, v);
-    n_idx[new->keys] = new->off;
-    node_insert_kv(new, k, l, (const void *)v);
-  }
-  // deal with the hole caused by this move
+  // move keys from `right` to `new`
+  memcpy(&n_keys[lmk], fixed_keys(right), rmk * sizeof(uint64_t));
+  memcpy(&n_vals[lmk], fixed_vals(right), rmk * value_bytes);
+  new->keys = lmk + rmk;
   node_delete_range(right, 0, rmk);
 
   // record replace fence key
@@ -673,73 +1911,207 @@ void node_adjust_many(node *new, node *left, node *right, char *okey, uint32_t *
   new->next  = right;
 }
 
-// replace old key with new key, if old key and new key have the same key length, this is just an in-place update,
-// but if they don't, pain in the ass
+// replace old key with new key, since all the keys have the same length, this is an in-place update
 int node_replace_key(node *n, const void *okey, uint32_t olen, const void *val,
   const void *key, uint32_t len)
 {
-  assert(n->level && n->keys && n->pre == 0);
-
-  int low = 0, high = (int)n->keys - 1;
-  index_t *index = node_index(n);
-  while (low <= high) {
-    int mid = (low + high) / 2;
+  assert(n->level && n->keys);
+  assert(olen == fixed_key_size && len == fixed_key_size);
 
-    get_kv_info(n, index[mid], key1, len1, val1);
-
-    int r = compare_key(key1, len1, okey, olen);
-    if (r == 0) {
-      assert(val1 == val);
-      if (olen == len) {
-        memcpy((void *)key1, key, len);
-        return 1;
-      } else {
-        node_delete_range(n, mid, mid + 1);
-        int r = node_insert(n, key, len, val);
-        return r;
-      }
-    } else if (r < 0) {
-      low  = mid + 1;
-    } else {
-      high = mid - 1;
-    }
-  }
+  uint64_t *keys = fixed_keys(n), k = fixed_key_to_int(okey);
+  uint32_t i = fixed_rank(keys, n->keys, k, 0);
+  if (i == n->keys || keys[i] != k)
+    return 2;
 
-  return 2;
+  assert((void *)fixed_vals(n)[i] == val);
+  keys[i] = fixed_key_to_int(key);
+  return 1;
 }
 
+#endif // FixedKey
+
 /****** BATCH operation ******/
 
 #define get_op(n, off) ((uint32_t)(*(uint8_t *)(get_ptr(n, off) - sizeof(uint8_t))))
+#define get_seq(n, off) ((uint32_t)(*(index_t *)(get_ptr(n, off) - sizeof(uint8_t) - index_byte)))
+
+/**
+ *   a batch can be chained with more segments so that it holds more kvs than one node can, every
+ *   segment is a batch on its own and the first segment is the batch itself, kvs are appended to
+ *   the last segment. `seq` of a kv is counted over the whole chain, segment `i` holds the kvs whose
+ *   `seq` is in [bases[i], bases[i + 1]). chained batch is always unsorted, workers sort all the
+ *   segments together and put the handles of kvs in key order to `order`,
+ *   a handle is (segment << 16) | offset.
+ *
+ *   every batch keeps its chain in `first`, results of the kvs in it are placed right after.
+**/
+typedef struct batch_chain
+{
+  uint32_t   number;    // segments in use
+  uint32_t   capacity;  // maximum segment number
+  uint32_t   allocated; // segments are kept for reuse after the batch is cleared
+  batch    **segments;  // segments[0] is the batch itself
+  uint32_t  *bases;     // `seq` of the first kv in each segment
+  uint32_t  *order;     // handles of all the kvs in key order
+  result     results[]; // results of the kvs in this segment
+}batch_chain;
+
+#define batch_chain_of(b) ((batch_chain *)(b)->first)
+#define batch_results(b)  (batch_chain_of(b)->results)
+
+#define kv_handle(seg, off) (((uint32_t)(seg) << 16) | (uint32_t)(off))
+#define handle_segment(h)   ((h) >> 16)
+#define handle_offset(h)    ((index_t)(h))
+
+#define chain_segment(b, s) ((s) ? batch_chain_of(b)->segments[s] : (b))
+#define chain_base(b, s)    ((s) ? batch_chain_of(b)->bases[s] : 0)
+
+// flags of batch stored in `sopt`
+#define batch_unsorted 1 // kvs are appended without sorting
+#define batch_modify   2 // batch has any op other than read and scan
+
+// maximum number of kv in a batch, each kv takes up at least `seq`, `op`, key length, value and index
+#define batch_max_keys() (batch_size / (index_byte + sizeof(uint8_t) + key_byte + value_bytes + index_byte))
 
 batch* new_batch()
 {
-  return new_node(Batch, 0);
+  batch *b = new_node(Batch, 0);
+  // batch does not have child, so we use `first` to place the chain and the results
+  batch_chain *c = (batch_chain *)malloc(sizeof(batch_chain) + sizeof(result) * batch_max_keys());
+  c->number    = 1;
+  c->capacity  = 1;
+  c->allocated = 1;
+  c->segments  = 0;
+  c->bases     = 0;
+  c->order     = 0;
+  b->first = (node *)c;
+  return b;
 }
 
 void free_batch(batch *b)
 {
+  batch_chain *c = batch_chain_of(b);
+  for (uint32_t i = 1; i < c->allocated; ++i)
+    free_batch(c->segments[i]);
+  free((void *)c->segments);
+  free((void *)c->bases);
+  free((void *)c->order);
+  free((void *)c);
   free_node((node *)b);
 }
 
-inline void batch_clear(batch *b)
+static inline void segment_clear(batch *b)
 {
   b->keys = 0;
   b->off  = 0;
+  b->pre  = 0;
+  b->sopt &= ~batch_modify;
+}
+
+void batch_clear(batch *b)
+{
+  batch_chain *c = batch_chain_of(b);
+  for (uint32_t i = 1; i < c->number; ++i)
+    segment_clear(c->segments[i]);
+  c->number = 1;
+  segment_clear(b);
+}
+
+// let batch grow to `number` segments when it's full, so that workers sync once for many more kvs,
+// a chained batch is always unsorted
+void batch_set_segments(batch *b, uint32_t number)
+{
+  batch_chain *c = batch_chain_of(b);
+  assert(b->keys == 0 && number >= c->allocated && number <= (1 << 16));
+  c->capacity = number;
+  if (number == 1) return ;
+
+  assert(c->segments = (batch **)realloc(c->segments, sizeof(batch *) * number));
+  assert(c->bases = (uint32_t *)realloc(c->bases, sizeof(uint32_t) * number));
+  c->segments[0] = b;
+  c->bases[0] = 0;
+  b->sopt |= batch_unsorted;
+}
+
+// number of kvs in all the segments
+uint32_t batch_get_keys(batch *b)
+{
+  batch_chain *c = batch_chain_of(b);
+  if (likely(c->number == 1))
+    return b->keys;
+  return c->bases[c->number - 1] + c->segments[c->number - 1]->keys;
+}
+
+// start the next segment when the last one is full, return 0 if batch can not grow any more
+static batch* batch_next_segment(batch *b)
+{
+  batch_chain *c = batch_chain_of(b);
+  if (c->number == c->capacity) return 0;
+
+  if (c->number == c->allocated) {
+    batch *s = new_batch();
+    s->sopt |= batch_unsorted;
+    c->segments[c->allocated++] = s;
+    assert(c->order = (uint32_t *)realloc(c->order, sizeof(uint32_t) * c->allocated * batch_max_keys()));
+  }
+  batch *last = c->segments[c->number - 1];
+  c->bases[c->number] = c->bases[c->number - 1] + last->keys;
+  return c->segments[c->number++];
+}
+
+// unsorted batch appends kv without keeping the index sorted, workers sort it before execution
+void batch_set_unsorted(batch *b, int unsorted)
+{
+  assert(b->keys == 0 && (unsorted || batch_chain_of(b)->capacity == 1));
+  if (unsorted)
+    b->sopt |= batch_unsorted;
+  else
+    b->sopt &= ~batch_unsorted;
+}
+
+inline int batch_is_unsorted(batch *b)
+{
+  return (int)(b->sopt & batch_unsorted);
+}
+
+// batch that only has read and scan does not modify the palm tree
+inline int batch_is_read_only(batch *b)
+{
+  return !(b->sopt & batch_modify);
 }
 
-// insert a kv into node, this function allows duplicate key
-static int batch_write(batch *b, uint32_t op, const void *key1, uint32_t len1, const void *val)
+// offset of the first kv added to batch, its key holds the common prefix of the batch
+#define batch_first_kv (index_byte /* seq */ + sizeof(uint8_t) /* op */)
+
+// common prefix of all the keys in batch, batch may be empty
+const void* batch_get_prefix(batch *b, uint32_t *len)
+{
+  *len = b->pre;
+  return get_key(b, batch_first_kv);
+}
+
+// insert a kv into one segment, this function allows duplicate key
+static int segment_write(batch *b, uint32_t op, const void *key1, uint32_t len1, const void *val)
 {
+  // common prefix shrinks to what the new key shares with it
+  uint32_t pre = len1;
+  if (likely(b->keys)) {
+    const char *pkey = get_key(b, batch_first_kv), *nkey = (const char *)key1;
+    uint32_t max = b->pre < len1 ? b->pre : len1;
+    for (pre = 0; pre < max && pkey[pre] == nkey[pre]; ++pre) ;
+  }
+
   int low = 0, high = (int)b->keys - 1;
   index_t *index = batch_index(b);
 
-  while (low <= high) {
+  // for unsorted batch, kv is always put at the front of the index, so index is in reverse order of `seq`,
+  // all the keys share `pre` bytes with the new key, so only the bytes after them are compared
+  while (likely(!(b->sopt & batch_unsorted)) && low <= high) {
     int mid = (low + high) / 2;
 
     get_key_info(b, index[mid], key2, len2);
 
-    int r = compare_key(key2, len2, key1, len1);
+    int r = compare_key((const char *)key2 + pre, len2 - pre, (const char *)key1 + pre, len1 - pre);
     if (r <= 0)
       low  = mid + 1;
     else
@@ -749,10 +2121,13 @@ static int batch_write(batch *b, uint32_t op, const void *key1, uint32_t len1, c
   --index;
 
   // check if there is enough space
-  if (unlikely((char *)b->data + (b->off + sizeof(uint8_t) /* op */ + key_byte + len1 + value_bytes) > (char *)index))
+  if (unlikely((char *)b->data + (b->off + index_byte /* seq */ + sizeof(uint8_t) /* op */ + key_byte + len1 +
+    value_bytes) > (char *)index))
     return -1;
 
-  // set op type before kv
+  // set seq and op type before kv
+  *((index_t *)(b->data + b->off)) = (index_t)b->keys;
+  b->off += index_byte;
   *((uint8_t *)(b->data + b->off)) = (uint8_t)op;
   b->off += sizeof(uint8_t);
 
@@ -760,10 +2135,69 @@ static int batch_write(batch *b, uint32_t op, const void *key1, uint32_t len1, c
   index[low] = b->off;
 
   node_insert_kv(b, key1, len1, val);
+  b->pre = pre;
 
+  if (op != Read && op != Scan)
+    b->sopt |= batch_modify;
+
+  return 1;
+}
+
+// insert a kv into the last segment of batch, the first segment keeps the common prefix and
+// the flags of the whole batch
+static int batch_write(batch *b, uint32_t op, const void *key, uint32_t len, const void *val)
+{
+  batch_chain *c = batch_chain_of(b);
+  if (likely(c->capacity == 1))
+    return segment_write(b, op, key, len, val);
+
+  batch *s = c->segments[c->number - 1];
+  if (segment_write(s, op, key, len, val) == -1) {
+    if ((s = batch_next_segment(b)) == 0)
+      return -1;
+    assert(segment_write(s, op, key, len, val) == 1);
+  }
+
+  if (s != b) {
+    const char *pkey = get_key(b, batch_first_kv), *nkey = (const char *)key;
+    uint32_t pre = 0, max = b->pre < len ? b->pre : len;
+    for (; pre < max && pkey[pre] == nkey[pre]; ++pre) ;
+    b->pre = pre;
+    b->sopt |= s->sopt & batch_modify;
+  }
   return 1;
 }
 
+// find the segment and offset of kv at index `idx` of the sorted batch
+static inline batch* batch_locate(batch *b, uint32_t idx, index_t *off)
+{
+  batch_chain *c = batch_chain_of(b);
+  if (likely(c->number == 1)) {
+    // TODO: remove this
+    assert(idx < b->keys);
+    *off = batch_index(b)[idx];
+    return b;
+  }
+  uint32_t h = c->order[idx];
+  *off = handle_offset(h);
+  return c->segments[handle_segment(h)];
+}
+
+// find the segment that holds the kv with `seq`
+static uint32_t batch_segment_of(batch *b, uint32_t seq)
+{
+  batch_chain *c = batch_chain_of(b);
+  uint32_t lo = 0, hi = c->number - 1;
+  while (lo < hi) {
+    uint32_t mid = (lo + hi + 1) / 2;
+    if (c->bases[mid] <= seq)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return lo;
+}
+
 int batch_add_write(batch *b, const void *key, uint32_t len, const void *val)
 {
   return batch_write(b, Write, key, len, val);
@@ -774,14 +2208,39 @@ int batch_add_read(batch *b, const void *key, uint32_t len)
   return batch_write(b, Read, key, len, 0);
 }
 
+int batch_add_delete(batch *b, const void *key, uint32_t len)
+{
+  return batch_write(b, Delete, key, len, 0);
+}
+
+// add `val` to the value of `key` as an unsigned integer
+int batch_add_add(batch *b, const void *key, uint32_t len, const void *val)
+{
+  return batch_write(b, Add, key, len, val);
+}
+
+// replace the value of `key` with `val` only if it equals `expect`
+int batch_add_cas(batch *b, const void *key, uint32_t len, const void *expect, const void *val)
+{
+  if (batch_write(b, Cas, key, len, val) == -1)
+    return -1;
+  batch *s = chain_segment(b, batch_chain_of(b)->number - 1);
+  batch_results(s)[s->keys - 1].val = (void *)expect;
+  return 1;
+}
+
+int batch_add_get_or_insert(batch *b, const void *key, uint32_t len, const void *val)
+{
+  return batch_write(b, GetOrInsert, key, len, val);
+}
+
 // read a kv at index
 inline void batch_read_at(batch *b, uint32_t idx, uint32_t *op, void **key, uint32_t *len, void **val)
 {
-  // TODO: remove this
-  assert(idx < b->keys);
-  index_t *index = batch_index(b);
-  get_kv_ptr(b, index[idx], k, l, v);
-  *op = get_op(b, index[idx]);
+  index_t off;
+  b = batch_locate(b, idx, &off);
+  get_kv_ptr(b, off, k, l, v);
+  *op = get_op(b, off);
   *key = (void *)k;
   *len = l;
   *val = (void *)v;
@@ -789,9 +2248,207 @@ inline void batch_read_at(batch *b, uint32_t idx, uint32_t *op, void **key, uint
 
 inline void* batch_get_value_at(batch *b, uint32_t idx)
 {
-  if (idx >= b->keys || b->keys == 0) return 0;
-  index_t *index = batch_index(b);
-  return get_val(b, index[idx]);
+  if (idx >= batch_get_keys(b)) return 0;
+  index_t off;
+  b = batch_locate(b, idx, &off);
+  return get_val(b, off);
+}
+
+// set the result of kv at index, result is placed according to the order kv is added
+void batch_set_result_at(batch *b, uint32_t idx, uint32_t status, const void *val)
+{
+  index_t off;
+  b = batch_locate(b, idx, &off);
+  result *res = &batch_results(b)[get_seq(b, off)];
+  res->status = status;
+  res->val    = (void *)val;
+}
+
+// get the result value of kv at index
+void* batch_get_result_at(batch *b, uint32_t idx)
+{
+  index_t off;
+  b = batch_locate(b, idx, &off);
+  return batch_results(b)[get_seq(b, off)].val;
+}
+
+// get the result of the `seq`th kv added to this batch, return result status
+uint32_t batch_get_result(batch *b, uint32_t seq, void **val)
+{
+  if (unlikely(batch_chain_of(b)->number > 1)) {
+    uint32_t s = batch_segment_of(b, seq);
+    seq -= chain_base(b, s);
+    b = chain_segment(b, s);
+  }
+  assert(seq < b->keys);
+  result *res = &batch_results(b)[seq];
+  if (val) *val = res->val;
+  return res->status;
+}
+
+int batch_add_scan(batch *b, const void *key, uint32_t len, scan *s)
+{
+  return batch_write(b, Scan, key, len, (const void *)s);
+}
+
+/**
+ *   unsorted batch is sorted by msd radix sort over key bytes, keys are first partitioned by
+ *   their first byte into `radix_buckets` buckets (this can be done by multiple workers,
+ *   each one counts and scatters a part of the batch), then each bucket is sorted on its own.
+ *   bucket 0 is for keys that have no byte left. every pass is stable and the partition pass
+ *   reads kvs in `seq` order, so duplicate keys are kept in the order they are added.
+ *   bytes of the common prefix of the batch would all fall into one bucket, so we start after them.
+ *   kvs are sorted as handles so that all the segments of a chained batch are sorted together.
+**/
+
+#define radix_insertion_sort 32
+
+#define radix_byte(n, off, depth) \
+  (get_len(n, off) > (depth) ? (uint32_t)(*(uint8_t *)(get_key(n, off) + (depth))) + 1 : 0)
+
+static inline uint32_t handle_radix_byte(batch *b, uint32_t h, uint32_t depth)
+{
+  batch *s = chain_segment(b, handle_segment(h));
+  return radix_byte(s, handle_offset(h), depth);
+}
+
+static inline const char* handle_key(batch *b, uint32_t h, uint32_t *len)
+{
+  batch *s = chain_segment(b, handle_segment(h));
+  *len = get_len(s, handle_offset(h));
+  return get_key(s, handle_offset(h));
+}
+
+// count kvs in [beg, end) (in `seq` order) for each bucket of the first key byte after common prefix
+void batch_radix_count(batch *b, uint32_t beg, uint32_t end, uint32_t *count)
+{
+  memset(count, 0, sizeof(uint32_t) * radix_buckets);
+  for (uint32_t s = beg < end ? batch_segment_of(b, beg) : 0, i = beg; i < end; ++s) {
+    batch *seg = chain_segment(b, s);
+    index_t *index = batch_index(seg);
+    uint32_t base = chain_base(b, s), last = base + seg->keys < end ? base + seg->keys : end;
+    // kvs of unsorted segment are in reverse order of `seq` in its index
+    for (; i < last; ++i)
+      ++count[radix_byte(seg, index[seg->keys - 1 - (i - base)], b->pre)];
+  }
+}
+
+// put handles of kvs in [beg, end) (in `seq` order) to `tmp` according to `offset` of each bucket
+void batch_radix_scatter(batch *b, uint32_t beg, uint32_t end, uint32_t *offset, uint32_t *tmp)
+{
+  for (uint32_t s = beg < end ? batch_segment_of(b, beg) : 0, i = beg; i < end; ++s) {
+    batch *seg = chain_segment(b, s);
+    index_t *index = batch_index(seg);
+    uint32_t base = chain_base(b, s), last = base + seg->keys < end ? base + seg->keys : end;
+    for (; i < last; ++i) {
+      index_t off = index[seg->keys - 1 - (i - base)];
+      tmp[offset[radix_byte(seg, off, b->pre)]++] = kv_handle(s, off);
+    }
+  }
+}
+
+// sort `a` in [lo, hi) whose keys share the first `depth` bytes, `s` is scratch space
+static void radix_sort(batch *b, uint32_t *a, uint32_t *s, uint32_t lo, uint32_t hi, uint32_t depth)
+{
+  if (hi - lo <= radix_insertion_sort) {
+    for (uint32_t i = lo + 1; i < hi; ++i) {
+      uint32_t h = a[i], len;
+      const char *key = handle_key(b, h, &len) + depth;
+      len -= depth;
+      uint32_t j = i;
+      for (; j > lo; --j) {
+        uint32_t pre = a[j - 1], plen;
+        const char *pkey = handle_key(b, pre, &plen) + depth;
+        if (compare_key(pkey, plen - depth, key, len) <= 0)
+          break;
+        a[j] = pre;
+      }
+      a[j] = h;
+    }
+    return ;
+  }
+
+  uint32_t count[radix_buckets];
+  memset(count, 0, sizeof(count));
+  for (uint32_t i = lo; i < hi; ++i)
+    ++count[handle_radix_byte(b, a[i], depth)];
+
+  uint32_t offset[radix_buckets];
+  for (uint32_t i = 0, sum = lo; i < radix_buckets; ++i) {
+    offset[i] = sum;
+    sum += count[i];
+  }
+  for (uint32_t i = lo; i < hi; ++i)
+    s[offset[handle_radix_byte(b, a[i], depth)]++] = a[i];
+  memcpy(&a[lo], &s[lo], (hi - lo) * sizeof(uint32_t));
+
+  // keys in bucket 0 are all the same, no need to sort
+  for (uint32_t i = 1, beg = lo + count[0]; i < radix_buckets; beg += count[i++])
+    if (count[i] > 1)
+      radix_sort(b, a, s, beg, beg + count[i], depth + 1);
+}
+
+// sort bucket [lo, hi) in `tmp` partitioned by `batch_radix_scatter`, then put it to batch index,
+// or to `order` if batch is chained, buckets are disjoint, so they can be sorted by different
+// workers at the same time, second half of `tmp` is used as scratch space
+void batch_radix_sort(batch *b, uint32_t *tmp, uint32_t lo, uint32_t hi, uint32_t bucket)
+{
+  if (lo == hi) return ;
+  if (bucket && hi - lo > 1)
+    radix_sort(b, tmp, tmp + batch_get_keys(b), lo, hi, b->pre + 1);
+
+  batch_chain *c = batch_chain_of(b);
+  if (c->number > 1) {
+    memcpy(&c->order[lo], &tmp[lo], (hi - lo) * sizeof(uint32_t));
+  } else {
+    index_t *index = batch_index(b);
+    for (uint32_t i = lo; i < hi; ++i)
+      index[i] = handle_offset(tmp[i]);
+  }
+}
+
+// sort an unsorted batch in a single thread, `tmp` should have room for `batch_sort_buffer` handles
+void batch_sort(batch *b, uint32_t *tmp)
+{
+  uint32_t keys = batch_get_keys(b);
+  uint32_t count[radix_buckets];
+  batch_radix_count(b, 0, keys, count);
+
+  uint32_t offset[radix_buckets];
+  for (uint32_t i = 0, sum = 0; i < radix_buckets; ++i) {
+    offset[i] = sum;
+    sum += count[i];
+  }
+  batch_radix_scatter(b, 0, keys, offset, tmp);
+
+  for (uint32_t i = 0, beg = 0; i < radix_buckets; beg += count[i++])
+    batch_radix_sort(b, tmp, beg, beg + count[i], i);
+}
+
+void scan_init(scan *s, const void *end, uint32_t elen, uint32_t limit, char *buf, uint32_t size)
+{
+  s->end   = end;
+  s->elen  = elen;
+  s->limit = limit;
+  s->keys  = 0;
+  s->off   = 0;
+  s->size  = size;
+  s->buf   = buf;
+}
+
+// iterate the kv pairs collected by a scan, `*off` should be 0 at first,
+// return 0 if there is no more kv pair
+int scan_next(scan *s, uint32_t *off, void **key, uint32_t *len, void **val)
+{
+  if (*off >= s->off)
+    return 0;
+
+  char *ptr = s->buf + *off;
+  *len = (uint32_t)(*(len_t *)ptr);
+  *key = (void *)(ptr + key_byte);
+  *val = (void *)(*(val_t *)(ptr + key_byte + *len));
+  *off += key_byte + *len + value_bytes;
+  return 1;
 }
 
 inline void path_clear(path *p)
@@ -807,7 +2464,8 @@ inline void path_copy(const path *src, path *dst)
 
 inline void path_set_kv_id(path *p, uint32_t id)
 {
-  p->id = id;
+  p->id  = id;
+  p->run = 1;
 }
 
 inline uint32_t path_get_kv_id(path *p)
@@ -815,6 +2473,17 @@ inline uint32_t path_get_kv_id(path *p)
   return p->id;
 }
 
+// next kv in the batch has the same key, so it shares this path
+inline void path_extend_kv_run(path *p)
+{
+  ++p->run;
+}
+
+inline uint32_t path_get_kv_run(path *p)
+{
+  return p->run;
+}
+
 inline void path_push_node(path *p, node *n)
 {
   assert(p->depth < max_descend_depth);
@@ -857,6 +2526,8 @@ static char* format_kv(char *ptr, char *end, node* n, uint32_t off)
   return ptr;
 }
 
+#ifndef FixedKey
+
 static char* format_child(char *ptr, char *end, node* n, uint32_t off)
 {
   // ptr += snprintf(ptr, end - ptr, "%4u  ", off);
@@ -881,12 +2552,16 @@ static char* format_child(char *ptr, char *end, node* n, uint32_t off)
   return ptr;
 }
 
+#endif // FixedKey
+
 void node_print(node *n, int detail)
 {
   assert(n);
-  int size = node_size * 4;
+  int size = node_bytes(n) * 4;
   char buf[size], *ptr = buf, *end = buf + size;
+#ifndef FixedKey
   char* (*format)(char *, char *, node *, uint32_t) = n->level == 0 ? format_kv : format_child;
+#endif
 
   ptr += snprintf(ptr, end - ptr, "id: %u  ", n->id);
   ptr += snprintf(ptr, end - ptr, "type: %s  ",
@@ -900,6 +2575,13 @@ void node_print(node *n, int detail)
   if (n->level && (n->type & Blink) == 0)
     ptr += snprintf(ptr, end - ptr, "first: %u\n", n->first->id);
 
+#ifdef FixedKey
+  uint64_t *keys = fixed_keys(n);
+  val_t    *vals = fixed_vals(n);
+  for (uint32_t i = 0; i < n->keys; ++i)
+    if (detail || i == 0 || i == n->keys - 1)
+      ptr += snprintf(ptr, end - ptr, "%lu  %lu\n", keys[i], vals[i]);
+#else
   index_t *index = node_index(n);
   if (detail) {
     for (uint32_t i = 0; i < n->keys; ++i)
@@ -910,6 +2592,7 @@ void node_print(node *n, int detail)
     if (n->keys > 1)
       ptr = (*format)(ptr, end, n, index[n->keys - 1]);
   }
+#endif // FixedKey
 
   if (n->next && (n->type & Blink) == 0)
     ptr += snprintf(ptr, end - ptr, "next: %u\n", n->next->id);
@@ -917,6 +2600,19 @@ void node_print(node *n, int detail)
   printf("%s\n", buf);
 }
 
+static const char* op_name(uint32_t op)
+{
+  switch (op) {
+    case Write:       return "w";
+    case Scan:        return "s";
+    case Delete:      return "d";
+    case Add:         return "a";
+    case Cas:         return "c";
+    case GetOrInsert: return "g";
+    default:          return "r";
+  }
+}
+
 void batch_print(batch *b, int detail)
 {
   assert(b);
@@ -929,16 +2625,16 @@ void batch_print(batch *b, int detail)
   index_t *index = batch_index(b);
   if (detail) {
     for (uint32_t i = 0; i < b->keys; ++i) {
-      ptr += snprintf(ptr, end - ptr, "%s ", get_op(b, index[i]) == Write ? "w" : "r");
+      ptr += snprintf(ptr, end - ptr, "%s ", op_name(get_op(b, index[i])));
       ptr = format_kv(ptr, end, b, index[i]);
     }
   } else {
     if (b->keys > 0) {
-      ptr += snprintf(ptr, end - ptr, "%s ", get_op(b, index[0]) == Write ? "w" : "r");
+      ptr += snprintf(ptr, end - ptr, "%s ", op_name(get_op(b, index[0])));
       ptr = format_kv(ptr, end, b, index[0]);
     }
     if (b->keys > 1) {
-      ptr += snprintf(ptr, end - ptr, "%s ", get_op(b, index[b->keys - 1]) == Write ? "w" : "r");
+      ptr += snprintf(ptr, end - ptr, "%s ", op_name(get_op(b, index[b->keys - 1])));
       ptr = format_kv(ptr, end, b, index[b->keys - 1]);
     }
   }
@@ -953,7 +2649,18 @@ static void validate(node *n, int is_batch)
 
   if (n->keys == 0) return ;
 
-  index_t *index = node_index(n);
+#ifdef FixedKey
+  if (is_batch == 0) {
+    assert(n->pre == 0 && n->keys <= fixed_capacity(n));
+    uint64_t *keys = fixed_keys(n);
+    for (uint32_t i = 1; i < n->keys; ++i)
+      assert(keys[i - 1] < keys[i]);
+    return ;
+  }
+#endif
+
+  // batch may have different size from node
+  index_t *index = is_batch ? batch_index(n) : node_index(n);
   char *pre_key = get_key(n, index[0]);
   uint32_t pre_len = get_len(n, index[0]);
 
@@ -966,6 +2673,33 @@ static void validate(node *n, int is_batch)
     pre_key = (char *)cur_key;
     pre_len = cur_len;
   }
+
+#if defined(Fingerprint) && !defined(FixedKey)
+  if (is_batch == 0 && n->sopt && n->level == 0) {
+    uint8_t *fp = node_fp(n);
+    assert((n->data + n->off) <= (char *)fp);
+    for (uint32_t i = 0; i < n->keys; ++i) {
+      get_key_info(n, index[i], key, len);
+      assert(fp[i] == key_fp(key, len));
+    }
+  }
+#endif
+
+#if defined(Heads) && !defined(FixedKey)
+  if (is_batch == 0 && n->sopt && n->level) {
+    head_layout hl;
+    assert((n->data + n->off) <= node_head_layout(n, n->keys, &hl));
+    for (uint32_t i = 0; i < n->keys; ++i) {
+      get_key_info(n, index[i], key, len);
+      assert(hl.base[0][i] == key_head(key, len, n->sopt - 1));
+    }
+    for (uint32_t l = 1; l < hl.levels; ++l)
+      for (uint32_t j = 0; j < hl.count[l]; ++j) {
+        uint32_t k = j * head_fanout + head_fanout - 1;
+        assert(hl.base[l][j] == hl.base[l - 1][k < hl.count[l - 1] ? k : hl.count[l - 1] - 1]);
+      }
+  }
+#endif
 }
 
 void node_validate(node *n)
@@ -975,7 +2709,19 @@ void node_validate(node *n)
 
 void batch_validate(batch *n)
 {
-  validate(n, 1);
+  batch_chain *c = batch_chain_of(n);
+  if (c->number == 1) {
+    validate(n, 1);
+    return ;
+  }
+
+  // kvs of all the segments are in key order
+  uint32_t keys = batch_get_keys(n), plen, clen;
+  for (uint32_t i = 1; i < keys; ++i) {
+    const char *pkey = handle_key(n, c->order[i - 1], &plen);
+    const char *ckey = handle_key(n, c->order[i], &clen);
+    assert(compare_key(pkey, plen, ckey, clen) <= 0);
+  }
 }
 
 // this function is used to verify that a b+tree node is validate
@@ -998,7 +2744,7 @@ void btree_node_validate(node *n)
   node_get_whole_key(n, n->keys - 1, last_key, &last_len);
 
   // validate the last key in this node is smaller than the first key in next node
-  if (n->next) {
+  if (n->next && n->next->keys) {
     char next_key[max_key_size];
     uint32_t next_len;
     node_get_whole_key(n->next, 0, next_key, &next_len);
@@ -1010,23 +2756,46 @@ void btree_node_validate(node *n)
     assert(n->first != 0);
 
     // validate that the first key in this node is larger than the last key in the first child
+    // child can be empty after deletion
     char child_last_key[max_key_size], child_first_key[max_key_size];
     uint32_t child_last_len, child_first_len;
-    node_get_whole_key(n->first, n->first->keys - 1, child_last_key, &child_last_len);
-    assert(compare_key(child_last_key, child_last_len, first_key, first_len) < 0);
+    if (n->first->keys) {
+      node_get_whole_key(n->first, n->first->keys - 1, child_last_key, &child_last_len);
+      assert(compare_key(child_last_key, child_last_len, first_key, first_len) < 0);
+    }
 
     // validate that the last key in this node is smaller than or equal the first key in the last child
+#ifdef FixedKey
+    node *last_child = (node *)fixed_vals(n)[n->keys - 1];
+#else
     index_t *index = node_index(n);
     node *last_child = (node *)get_val(n, index[n->keys - 1]);
-    node_get_whole_key(last_child, 0, child_first_key, &child_first_len);
-    int r = compare_key(last_key, last_len, child_first_key, child_first_len);
-    assert(r <= 0); // equal is valid
+#endif
+    if (last_child->keys) {
+      node_get_whole_key(last_child, 0, child_first_key, &child_first_len);
+      int r = compare_key(last_key, last_len, child_first_key, child_first_len);
+      assert(r <= 0); // equal is valid
+    }
 
   } else {
     assert(n->first == 0);
   }
 }
 
+#ifdef FixedKey
+int node_try_compression(node *n, const void *key, uint32_t len)
+{
+  (void)n;
+  (void)key;
+  (void)len;
+  return 0;
+}
+
+float node_get_coverage(node *n)
+{
+  return ((float)(sizeof(node) + n->keys * (fixed_key_size + value_bytes))) / node_bytes(n);
+}
+#else
 int node_try_compression(node *n, const void *key, uint32_t len)
 {
   return node_try_prefix_compression(n, key, len);
@@ -1034,8 +2803,9 @@ int node_try_compression(node *n, const void *key, uint32_t len)
 
 float node_get_coverage(node *n)
 {
-  return ((float)((n->data + (n->off + n->keys * index_byte)) - (char *)n)) / (node_size - node_offset);
+  return ((float)((n->data + (n->off + n->keys * index_byte)) - (char *)n)) / node_bytes(n);
 }
+#endif // FixedKey
 
 uint32_t node_get_total_id()
 {
@@ -8,8 +8,8 @@
  *   B+ tree node is k-v storage unit & internal index unit
  *
  *   layout of a node in bytes:
- *       type    level   sopt   prefix      id         keys        offset     next node    first child
- *     |   1   |   1   |   1   |   1   |     4     |     4     |     4     |      8      |      8      |
+ *       type    level   sopt   prefix    id   size     keys        offset     next node    first child
+ *     |   1   |   1   |   1   |   1   |   3   |  1  |     4     |     4     |      8      |      8      |
  *     |        prefix data        |                          kv paris                                 |
  *     |                                     kv pairs                                                  |
  *     |                                     kv pairs                                                  |
@@ -38,8 +38,13 @@
 #define Batch  (1 << 4)
 
 // op type
-#define Read  0
-#define Write 1
+#define Read   0
+#define Write  1
+#define Scan   2
+#define Delete 3
+#define Add    4 // add value to the existing value as an integer, insert it if key does not exist
+#define Cas    5 // replace the value if it equals the expected value
+#define GetOrInsert 6 // return the existing value, insert it if key does not exist
 
 // do not fucking change it
 typedef uint64_t val_t;
@@ -55,6 +60,13 @@ typedef uint8_t  len_t;
 
 #define max_key_size ((uint32_t)((len_t)~((uint64_t)0)))
 
+// with `FixedKey` defined, all the keys in tree nodes are `fixed_key_size` bytes,
+// nodes keep keys as integers in one sorted array and values in another,
+// there is no key length byte and no index, batch still uses the layout below
+#ifdef FixedKey
+#define fixed_key_size 8
+#endif
+
 // you can change uint16_t to uint32_t so that bigger size nodes are supported,
 // but index will take more space
 typedef uint16_t index_t;
@@ -64,14 +76,20 @@ typedef uint16_t index_t;
 #define node_max_size  (((uint32_t)1) << 16) // 64kb
                                              // if you set `index_t` to uint32_t,
                                              // the node_max_size can be up to 4gb
+#define branch_min_size (((uint32_t)1) << 10) //  1kb, branch node of palm tree can be smaller than leaf
 
 typedef struct __attribute__ ((packed))  node
 {
   uint32_t    type:8;   // Root or Branch or Leaf
   uint32_t   level:8;   // level this node in
-  uint32_t    sopt:8;   // for sequential insertion optimization, only for level 0
-  uint32_t     pre:8;   // prefix length, only used in level 0
-  uint32_t     id;      // id of this node, mainly for debug
+  uint32_t    sopt:8;   // for sequential insertion optimization, only for level 0,
+                        // with `Fingerprint` defined, leaf sets it if its key hashes are valid,
+                        // with `Heads` defined, branch sets it if its separator heads are valid,
+                        // for batch it has flags like unsorted and read only
+  uint32_t     pre:8;   // prefix length, only used in level 0, for batch it's the common prefix length of
+                        // all the keys
+  uint32_t      id:24;  // id of this node, mainly for debug
+  uint32_t    size:8;   // size of this node in kb
   uint32_t     keys;    // number of keys
   uint32_t     off;     // current data offset
   struct node *next;    // pointer to the right child
@@ -85,12 +103,19 @@ void set_batch_size(uint32_t size);
 uint32_t get_batch_size();
 int compare_key(const void *key1, uint32_t len1, const void *key2, uint32_t len2);
 
+uint32_t get_level_node_size(uint8_t level, uint32_t size);
+
 node* new_node(uint8_t type, uint8_t level);
+node* new_node_with_size(uint8_t type, uint8_t level, uint32_t size);
+uint32_t node_get_size(node *n);
 void free_node(node *n);
 void free_btree_node(node *n);
 node* node_descend(node *n, const void *key, uint32_t len);
+uint32_t node_descend_skip(node *n, const void *pre, uint32_t plen);
+node* node_descend_from(node *n, const void *key, uint32_t len, uint32_t skip);
 int node_insert(node *n, const void *key, uint32_t len, const void *val);
 void* node_search(node *n, const void *key, uint32_t len);
+val_t* node_search_value_ptr(node *n, const void *key, uint32_t len);
 void node_split(node *old, node *new, char *pkey, uint32_t *plen);
 int node_not_include_key(node *n, const void *key, uint32_t len);
 int node_adjust_few(node *left, node *right, char *okey, uint32_t *olen, char *key, uint32_t *len);
@@ -100,6 +125,12 @@ int node_replace_key(node *n, const void *okey, uint32_t olen, const void *val,
 void node_prefetch(node *n);
 int node_is_after_key(node *n, const void *key, uint32_t len);
 int node_need_move_right(node *n, const void *key, uint32_t len);
+int node_delete(node *n, const void *key, uint32_t len, void **val);
+int node_get_child_key(node *n, node *child, char *key, uint32_t *len);
+uint32_t node_child_prefix(node *n, node *child);
+int node_compress_branch(node *n, uint32_t max);
+int node_is_underfull(node *n);
+int node_merge(node *left, node *right, const void *key, uint32_t len);
 
 void set_node_offset(uint32_t offset);
 void node_init(node *n, uint8_t type, uint8_t level);
@@ -109,33 +140,114 @@ void node_insert_fence(node *old, node *new, void *next, char *pkey, uint32_t *p
  *   batch is a wrapper for node with some difference, key may be duplicated
  *
  *   layout of kv pair in batch:
- *            op       key len                           ptr
- *      |     1     |     1     |        key        |     8     |
+ *          seq         op       key len                           ptr
+ *      |     2     |     1     |     1     |        key        |     8     |
+ *
+ *   `seq` is the order in which the kv is added to the batch, it is used to locate the result
+ *   of the kv, results are placed in a separate array pointed by `first`, the expected value of
+ *   `Cas` is kept in its result until the kv is executed
+ *
+ *   keys in a batch often share a long prefix, `pre` tracks the length of their common prefix,
+ *   the prefix bytes are those of the first kv, sorting and descending skip them
+ *
+ *   index is kept sorted on every insert by default, an unsorted batch just appends kvs
+ *   and leaves the sort to palm tree workers, which is much cheaper for the producer
+ *
+ *   a batch can hold at most a few thousand kvs, which is too few to amortize the syncs among many
+ *   workers, so a batch can be chained with more segments of the same size, kvs of all the segments
+ *   are sorted together by workers and seen as one sorted sequence, `seq` and index of a kv are
+ *   counted over all the segments, use `batch_get_keys` to get the number of kvs
 **/
 // TODO: different size for node and batch, batch size can be much larger than node size
 typedef node batch;
 
+// result status
+#define NotFound 0
+#define Found    1
+#define Inserted 2
+#define Updated  3
+#define Deleted  4
+#define Mismatch 5 // value does not equal the expected value of `Cas`
+
+typedef struct result
+{
+  uint32_t  status; // result status
+  void     *val;    // value for read, previous value for write and delete, kv number for scan,
+                    // previous value for add and cas, existing value for get or insert
+}result;
+
 batch* new_batch();
 void free_batch(batch *b);
 void batch_clear(batch *b);
+void batch_set_segments(batch *b, uint32_t number);
+uint32_t batch_get_keys(batch *b);
 int batch_add_write(batch *b, const void *key, uint32_t len, const void *val);
 int batch_add_read(batch *b, const void *key, uint32_t len);
+int batch_add_delete(batch *b, const void *key, uint32_t len);
+int batch_add_add(batch *b, const void *key, uint32_t len, const void *val);
+int batch_add_cas(batch *b, const void *key, uint32_t len, const void *expect, const void *val);
+int batch_add_get_or_insert(batch *b, const void *key, uint32_t len, const void *val);
 void batch_read_at(batch *b, uint32_t idx, uint32_t *op, void **key, uint32_t *len, void **val);
 void* batch_get_value_at(batch *b, uint32_t idx);
+void batch_set_result_at(batch *b, uint32_t idx, uint32_t status, const void *val);
+void* batch_get_result_at(batch *b, uint32_t idx);
+uint32_t batch_get_result(batch *b, uint32_t seq, void **val);
+void batch_set_unsorted(batch *b, int unsorted);
+int batch_is_unsorted(batch *b);
+int batch_is_read_only(batch *b);
+const void* batch_get_prefix(batch *b, uint32_t *len);
+
+// number of buckets for radix sort, one for each byte value and one for key end
+#define radix_buckets 257
+
+// number of kv handles needed to sort a batch with `keys` kvs
+#define batch_sort_buffer(keys) (2 * (keys))
+
+void batch_radix_count(batch *b, uint32_t beg, uint32_t end, uint32_t *count);
+void batch_radix_scatter(batch *b, uint32_t beg, uint32_t end, uint32_t *offset, uint32_t *tmp);
+void batch_radix_sort(batch *b, uint32_t *tmp, uint32_t lo, uint32_t hi, uint32_t bucket);
+void batch_sort(batch *b, uint32_t *tmp);
+
+/**
+ *   scan collects all the kv pairs in [start key, end key) in key order, it is carried by a batch
+ *   as a `Scan` op whose key is the start key, the kv pairs are copied to the caller supplied
+ *   buffer with the same layout as kv pair in node, but the key is always the whole key.
+ *   scan stops when it reaches end key, or collects `limit` kv pairs, or `buf` is full
+**/
+typedef struct scan
+{
+  const void *end;   // end key (exclusive), 0 means no upper bound
+  uint32_t    elen;  // end key length
+  uint32_t    limit; // maximum number of kv pairs to collect, 0 means no limit
+  uint32_t    keys;  // number of kv pairs collected
+  uint32_t    off;   // bytes used in `buf`
+  uint32_t    size;  // size of `buf`
+  char       *buf;   // caller supplied buffer to place the kv pairs
+}scan;
+
+void scan_init(scan *s, const void *end, uint32_t elen, uint32_t limit, char *buf, uint32_t size);
+int scan_next(scan *s, uint32_t *off, void **key, uint32_t *len, void **val);
+int batch_add_scan(batch *b, const void *key, uint32_t len, scan *s);
+int node_scan(node *n, const void *key, uint32_t len, scan *s);
 
 #define max_descend_depth 7 // should be enough levels for a b+ tree
 
-// the root to leaf descending path of one kv
+// the root to leaf descending path of one kv, or a run of kvs with the same key
 typedef struct path {
-  uint32_t  id;                       // id of the kv in the batch
-  uint32_t  depth;                    // node number in this path
+  uint32_t  id;                       // id of the first kv in the batch
+  uint16_t  depth;                    // node number in this path
+  uint16_t  run;                      // number of kvs with the same key starting from `id`
   node     *nodes[max_descend_depth]; // nodes[0] is root
 }path;
 
+#define max_kv_run ((uint32_t)UINT16_MAX) // kvs with the same key beyond it start a new path
+
 void path_clear(path *p);
 void path_copy(const path *src, path *dst);
 void path_set_kv_id(path *p, uint32_t id);
 uint32_t path_get_kv_id(path *p);
+void path_extend_kv_run(path *p);
+uint32_t path_get_kv_run(path *p);
 void path_push_node(path *p, node *n);
 node* path_get_node_at_level(path *p, uint32_t level);
 node* path_get_node_at_index(path *p, uint32_t idx);
@@ -143,6 +255,7 @@ uint32_t path_get_level(path *p);
 
 #define fence_insert  0
 #define fence_replace 1
+#define fence_delete  2
 
 typedef struct fence
 {
@@ -150,9 +263,9 @@ typedef struct fence
   node     *ptr;     // new node pointer
   uint32_t  type;    // fence type
   uint32_t  len;     // key length
-  char      key[16]; // key data, TODO: make it dynamic or change to `max_key_size`
+  char     *key;     // key data, up to `max_key_size`, recorded fence keeps it in worker's fence arena
   uint32_t  olen;    // old key length
-  char      okey[16];// old key data to replace, TODO: make it dynamic or change to `max_key_size`
+  char     *okey;    // old key data to replace, same as `key`
 }fence;
 
 #define likely(x)   (__builtin_expect(!!(x), 1))
@@ -8,6 +8,7 @@
 #include <string.h>
 #include <math.h>
 #include <assert.h>
+#include <sched.h>
 // TODO: remove this
 #include <stdio.h>
 
@@ -15,28 +16,39 @@
 #include "metric.h"
 #include "allocator.h"
 
+static const char *stage_sort     = "sort batch";
 static const char *stage_descend  = "descend to leaf";
 static const char *stage_sync     = "worker sync";
+static const char *stage_barrier  = "barrier wait";
 static const char *stage_redis    = "redistribute work";
 static const char *stage_leaves   = "modify leaves";
+static const char *stage_steal    = "steal leaves";
 static const char *stage_branches = "modify braches";
 static const char *stage_root     = "modify root";
+static const char *stage_scan     = "scan leaves";
+static const char *stage_ahead    = "descend ahead";
 
-static void do_palm_tree_execute(palm_tree *pt, batch *b, worker *w);
+static void do_palm_tree_execute(palm_tree *pt, batch *b, worker *w, uint64_t nth);
+static void free_retired_roots(palm_tree *pt);
 
 typedef struct thread_arg
 {
   palm_tree *pt;
-  worker    *wrk;
+  uint32_t   id;
+  uint32_t  *started; // number of threads that have created their worker
   bounded_queue *que;
+  int        cpu; // cpu this thread is pinned to, -1 means no affinity
 }thread_arg;
 
-static thread_arg* new_thread_arg(palm_tree *pt, worker *w, bounded_queue *q)
+static thread_arg* new_thread_arg(palm_tree *pt, uint32_t id, uint32_t *started, bounded_queue *q,
+  int cpu)
 {
   thread_arg *j = (thread_arg *)malloc(sizeof(thread_arg));
   j->pt  = pt;
-  j->wrk = w;
+  j->id  = id;
+  j->started = started;
   j->que = q;
+  j->cpu = cpu;
 
   return j;
 }
@@ -50,20 +62,34 @@ static void* run(void *arg)
 {
   thread_arg *j = (thread_arg *)arg;
   palm_tree *pt = j->pt;
-  worker *w= j->wrk;
   bounded_queue *q = j->que;
-  int q_idx = 0;
+  uint64_t q_idx = 0;
+
+#ifdef __linux__
+  // pin before this thread allocates anything, so that nodes it creates are first touched locally
+  if (j->cpu >= 0) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(j->cpu, &set);
+    assert(pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set) == 0);
+  }
+#endif
+
+  // worker and its path array are first touched by the pinned thread
+  worker *w = new_worker(j->id, pt->worker_num);
+  pt->workers[j->id] = w;
+  __atomic_add_fetch(j->started, 1, __ATOMIC_RELEASE);
 
   while (1) {
     // TODO: optimization?
     batch *bth = bounded_queue_get_at(q, &q_idx); // q_idx will be updated in the queue
 
     if (likely(bth))
-      do_palm_tree_execute(pt, bth, w);
+      do_palm_tree_execute(pt, bth, w, q_idx);
     else
       break;
 
-    // let worker 0 do the dequeue
+    // let worker 0 do the dequeue, this also marks the batch as done
     if (w->id == 0)
       bounded_queue_dequeue(q);
   }
@@ -72,7 +98,29 @@ static void* run(void *arg)
   return 0;
 }
 
+#ifdef __linux__
+// return the socket `cpu` is in, -1 if unknown
+static int cpu_socket(int cpu)
+{
+  char path[64];
+  snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+  FILE *fp = fopen(path, "r");
+  if (fp == 0) return -1;
+  int socket;
+  if (fscanf(fp, "%d", &socket) != 1) socket = -1;
+  fclose(fp);
+  return socket;
+}
+#endif
+
 palm_tree* new_palm_tree(int worker_num, int queue_size)
+{
+  return new_palm_tree_on_cpus(worker_num, queue_size, 0);
+}
+
+// worker i is pinned to cpus[i] if `cpus` is not NULL, cpus are stably sorted by socket first,
+// so that neighbour workers, which synchronize with each other, are in the same socket
+palm_tree* new_palm_tree_on_cpus(int worker_num, int queue_size, const int *cpus)
 {
 #ifdef Allocator
   init_allocator();
@@ -83,32 +131,81 @@ palm_tree* new_palm_tree(int worker_num, int queue_size)
   init_metric(worker_num);
 
   for (int i = 0; i < worker_num; ++i) {
+    register_metric(i, stage_sort, (void *)new_clock());
     register_metric(i, stage_descend, (void *)new_clock());
     register_metric(i, stage_sync, (void *)new_clock());
+    register_metric(i, stage_barrier, (void *)new_clock());
     register_metric(i, stage_redis, (void *)new_clock());
     register_metric(i, stage_leaves, (void *)new_clock());
+    register_metric(i, stage_steal, (void *)new_clock());
     register_metric(i, stage_branches, (void *)new_clock());
     register_metric(i, stage_root, (void *)new_clock());
+    register_metric(i, stage_scan, (void *)new_clock());
+    register_metric(i, stage_ahead, (void *)new_clock());
   }
 
   palm_tree *pt = (palm_tree *)malloc(sizeof(palm_tree));
-  pt->root = new_node(Root, 0);
+  // every level uses the global node size until `palm_tree_set_node_size` is called
+  pt->leaf_size = get_node_size();
+  pt->branch_size = get_node_size();
+  pt->root = new_node_with_size(Root, 0, pt->leaf_size);
 
   pt->worker_num = worker_num;
+  // compile option decides the default descend policy
+#ifdef Lazy
+  pt->descend = DescendLazy;
+#elif Level
+  pt->descend = DescendLevel;
+#else
+  pt->descend = DescendZigzag;
+#endif
   pt->queue = new_bounded_queue(queue_size);
   pt->ids = (pthread_t *)malloc(sizeof(pthread_t) * pt->worker_num);
   pt->workers = (worker **)malloc(sizeof(worker *) * pt->worker_num);
-
-  for (int i = 0; i < pt->worker_num; ++i) {
-    pt->workers[i] = new_worker(i, pt->worker_num);
-    if (i > 0)
-      worker_link(pt->workers[i - 1], pt->workers[i]);
+  // it's enough for a batch without chained segments, it grows when a bigger batch comes
+  pt->sort_cap = get_batch_size() / sizeof(uint32_t);
+  pt->sort_buf = (uint32_t *)malloc(sizeof(uint32_t) * pt->sort_cap);
+  pt->barrier_gen = 0;
+  pt->barrier_wait = 0;
+  pt->fence_cnt[0] = 0;
+  pt->fence_cnt[1] = 0;
+  pt->root_epoch = 0;
+  pt->stable_gen = 0;
+  pt->retired = 0;
+
+  int cpu[pt->worker_num];
+  for (int i = 0; i < pt->worker_num; ++i)
+    cpu[i] = cpus ? cpus[i] : -1;
+
+#ifdef __linux__
+  if (cpus) {
+    int socket[pt->worker_num];
+    for (int i = 0; i < pt->worker_num; ++i)
+      socket[i] = cpu_socket(cpu[i]);
+    // insertion sort is stable and worker number is small
+    for (int i = 1; i < pt->worker_num; ++i) {
+      int c = cpu[i], s = socket[i], j = i;
+      for (; j > 0 && socket[j - 1] > s; --j) {
+        cpu[j] = cpu[j - 1];
+        socket[j] = socket[j - 1];
+      }
+      cpu[j] = c;
+      socket[j] = s;
+    }
   }
+#endif
 
+  // every thread creates its own worker, workers are linked once they are all created,
+  // no batch can reach them before we return
+  uint32_t started = 0;
   for (int i = 0; i < pt->worker_num; ++i) {
-    thread_arg *arg = new_thread_arg(pt, pt->workers[i], pt->queue);
+    thread_arg *arg = new_thread_arg(pt, i, &started, pt->queue, cpu[i]);
     assert(pthread_create(&pt->ids[i], 0, run, (void *)arg) == 0);
   }
+  while (__atomic_load_n(&started, __ATOMIC_ACQUIRE) != (uint32_t)pt->worker_num)
+    sched_yield();
+  for (int i = 1; i < pt->worker_num; ++i)
+    worker_link(pt->workers[i - 1], pt->workers[i]);
 
   return pt;
 }
@@ -128,6 +225,9 @@ void free_palm_tree(palm_tree *pt)
 
   free((void *)pt->workers);
   free((void *)pt->ids);
+  free((void *)pt->sort_buf);
+
+  free_retired_roots(pt);
 
   // free the entire palm tree recursively
   free_btree_node(pt->root);
@@ -143,10 +243,65 @@ void palm_tree_flush(palm_tree *pt)
   bounded_queue_wait_empty(pt->queue);
 }
 
-// put task batch in the queue
-void palm_tree_execute(palm_tree *pt, batch *b)
+// put task batch in the queue, return a ticket which can be used to poll or wait for this batch,
+// batch can be reused once its ticket is done, ticket starts from 1 so 0 is always done
+uint64_t palm_tree_execute(palm_tree *pt, batch *b)
+{
+  return bounded_queue_enqueue(pt->queue, b, 0, 0) + 1;
+}
+
+// same as `palm_tree_execute`, but `cb` is called when the batch is done
+uint64_t palm_tree_execute_callback(palm_tree *pt, batch *b, batch_callback cb, void *arg)
+{
+  return bounded_queue_enqueue(pt->queue, b, cb, arg) + 1;
+}
+
+// return 1 if the batch with `ticket` is done, 0 otherwise
+int palm_tree_poll(palm_tree *pt, uint64_t ticket)
+{
+  return ticket == 0 || bounded_queue_is_done(pt->queue, ticket - 1);
+}
+
+// policy takes effect from the next batch a worker starts, it's ok that workers use different
+// policies for the same batch since each one descends its own part independently
+void palm_tree_set_descend_policy(palm_tree *pt, uint32_t policy)
+{
+  assert(policy <= DescendAdaptive);
+  __atomic_store_n(&pt->descend, policy, __ATOMIC_RELAXED);
+}
+
+// leaf is better to be big for prefix compression and sequential insertion, branch is visited
+// by every descent so it's better to be small, a size must be one returned by `get_level_node_size`
+// for its level, that is a multiple of 4kb for leaf and 1kb for branch, it can only be called
+// when the tree is still empty, return 0 on success, -1 if the sizes or the tree do not qualify
+int palm_tree_set_node_size(palm_tree *pt, uint32_t leaf_size, uint32_t branch_size)
+{
+  if (pt->root->level != 0 || pt->root->keys != 0)
+    return -1;
+  if (get_level_node_size(0, leaf_size) != leaf_size || get_level_node_size(1, branch_size) != branch_size)
+    return -1;
+
+  pt->leaf_size = leaf_size;
+  pt->branch_size = branch_size;
+
+  free_node(pt->root);
+  pt->root = new_node_with_size(Root, 0, pt->leaf_size);
+  return 0;
+}
+
+// how many times a waiting worker spins before it parks in the kernel, a small value leaves more
+// cpu to other threads when the machine is shared, 0 means park right away
+void palm_tree_set_spin(palm_tree *pt, uint32_t spin)
 {
-  bounded_queue_enqueue(pt->queue, b);
+  for (int i = 0; i < pt->worker_num; ++i)
+    worker_set_spin(pt->workers[i], spin);
+}
+
+// wait until the batch with `ticket` is done, batches before it are done as well
+void palm_tree_wait(palm_tree *pt, uint64_t ticket)
+{
+  if (ticket)
+    bounded_queue_wait_done(pt->queue, ticket - 1);
 }
 
 #ifdef Test
@@ -160,7 +315,7 @@ void palm_tree_validate(palm_tree *pt)
   while (ptr) {
     node *next = ptr->first;
     node *cur = ptr;
-    uint32_t count = 0;
+    uint32_t count = 0, prefix = 0;
     float coverage = 0;
     uint32_t less50 = 0;
     uint32_t less60 = 0;
@@ -169,6 +324,7 @@ void palm_tree_validate(palm_tree *pt)
     while (cur) {
       btree_node_validate(cur);
       if (cur->level == 0) average_prefix += cur->pre;
+      prefix += cur->pre;
       float c = node_get_coverage(cur);
       if (c < 0.5) ++less50;
       if (c < 0.6) ++less60;
@@ -178,8 +334,8 @@ void palm_tree_validate(palm_tree *pt)
       ++count;
       cur = cur->next;
     }
-    printf("level %u:  count: %-4u  coverage: %.2f%%  <50%%: %-4u  <60%%: %-4u  <70%%: %-4u  <80%%: %-4u\n",
-      ptr->level, count, (coverage * 100 / count), less50, less60, less70, less80);
+    printf("level %u:  count: %-4u  coverage: %.2f%%  <50%%: %-4u  <60%%: %-4u  <70%%: %-4u  <80%%: %-4u  prefix: %.2f\n",
+      ptr->level, count, (coverage * 100 / count), less50, less60, less70, less80, (float)prefix / count);
     total_count += count;
     total_coverage += coverage;
     average_prefix /= count;
@@ -192,48 +348,135 @@ void palm_tree_validate(palm_tree *pt)
 
 #endif /* Test */
 
-// only processed by worker 0
+// old roots can be read by workers descending ahead until the end of the batch,
+// a retired root has no sibling, so `next` links them
+static void free_retired_roots(palm_tree *pt)
+{
+  while (pt->retired) {
+    node *next = pt->retired->next;
+    free_node(pt->retired);
+    pt->retired = next;
+  }
+}
+
+// put fences of the old root level into a chain of new nodes from left to right, the fence that
+// does not fit in a node starts next node and goes up a level, until one node holds all of them
+static node* new_root_levels(palm_tree *pt, node *first, fence *fences, uint32_t number)
+{
+  fence *up = 0;
+  for (;;) {
+    node *head = new_node_with_size(Branch, first->level + 1, pt->branch_size), *curr = head;
+    head->first = first;
+    uint32_t promoted = 0;
+    for (uint32_t i = 0; i < number; ++i) {
+      int r = node_insert(curr, fences[i].key, fences[i].len, fences[i].ptr);
+      if (likely(r == 1)) continue;
+      assert(r == -1);
+      node *nn = new_node_with_size(Branch, curr->level, pt->branch_size);
+      nn->first = fences[i].ptr;
+      curr->next = nn;
+      curr = nn;
+      if (up == 0) assert(up = (fence *)malloc(sizeof(fence) * number));
+      // `promoted` <= `i`, so it's fine when `fences` is `up`
+      up[promoted] = fences[i];
+      up[promoted++].ptr = nn;
+    }
+    if (promoted == 0) {
+      head->type = Root;
+      free((void *)up);
+      return head;
+    }
+    first = head;
+    fences = up;
+    number = promoted;
+  }
+}
+
+// only processed by worker 0, root grows when it splits and shrinks when it has only one child,
+// new root is published before `root_epoch` is bumped, see `descend_ahead`
 static void handle_root_split(palm_tree *pt, worker *w)
 {
   uint32_t number;
   fence *fences;
   worker_get_fences(w, pt->root->level, &fences, &number);
 
-  if (likely(number == 0)) return ;
+  if (likely(number == 0)) {
+    // all the fence keys in root are deleted due to merge, its first child becomes new root
+    if (likely(pt->root->level == 0 || pt->root->keys))
+      return ;
+    while (pt->root->level && pt->root->keys == 0) {
+      node *old_root = pt->root;
+      old_root->first->type = Root;
+      __atomic_store_n(&pt->root, old_root->first, __ATOMIC_RELEASE);
+      old_root->next = pt->retired;
+      pt->retired = old_root;
+    }
+    __atomic_add_fetch(&pt->root_epoch, 1, __ATOMIC_RELEASE);
+    return ;
+  }
 
-  node *new_root = new_node(Root, pt->root->level + 1);
   // adjust old root type
   pt->root->type = pt->root->level == 0 ? Leaf : Branch;
-  // set old root as new root's first child
-  new_root->first = pt->root;
-
-  for (uint32_t i = 0; i < number; ++i) {
-    assert(node_insert(new_root, fences[i].key, fences[i].len, fences[i].ptr) == 1);
-  }
+  node *new_root = new_root_levels(pt, pt->root, fences, number);
 
   // replace old root
-  pt->root = new_root;
+  __atomic_store_n(&pt->root, new_root, __ATOMIC_RELEASE);
+  __atomic_add_fetch(&pt->root_epoch, 1, __ATOMIC_RELEASE);
 }
 
-#ifdef Lazy
-// descend to leaf node for key at `kidx`, using path at `pidx`
-static void descend_to_leaf_single(node *r, batch *b, worker *w, uint32_t kidx, uint32_t pidx)
+/**
+ *   keys of a batch share `plen` bytes of prefix, separators of a branch node that share them too
+ *   only need to compare the bytes after them, we remember the last branch node descended at each
+ *   level and how many prefix bytes its separators share, since consecutive keys of a batch mostly
+ *   go through the same branch nodes
+**/
+typedef struct descend_hint
+{
+  const void *pre;
+  uint32_t    plen;
+  node       *nodes[max_descend_depth];
+  uint32_t    skip[max_descend_depth];
+}descend_hint;
+
+static void descend_hint_init(descend_hint *h, batch *b)
+{
+  h->pre = batch_get_prefix(b, &h->plen);
+  for (uint32_t i = 0; i < max_descend_depth; ++i)
+    h->nodes[i] = 0;
+}
+
+static node* descend_with_hint(descend_hint *h, node *n, const void *key, uint32_t len)
+{
+  if (h->plen == 0)
+    return node_descend(n, key, len);
+
+  uint32_t level = n->level;
+  assert(level < max_descend_depth);
+  if (h->nodes[level] != n) {
+    h->nodes[level] = n;
+    h->skip[level] = node_descend_skip(n, h->pre, h->plen);
+  }
+  return node_descend_from(n, key, len, h->skip[level]);
+}
+
+// descend to leaf node for the key of path at `pidx`
+static void descend_to_leaf_single(node *r, batch *b, worker *w, uint32_t pidx, descend_hint *h)
 {
+  path* p = worker_get_path_at(w, pidx);
+
   uint32_t  op;
   void    *key;
   uint32_t len;
   void    *val;
   // get kv info
-  batch_read_at(b, kidx, &op, &key, &len, &val);
-
-  path* p = worker_get_path_at(w, pidx);
+  batch_read_at(b, path_get_kv_id(p), &op, &key, &len, &val);
 
   // loop until we reach level 0, push all the node to `p` along the way
   uint32_t level = r->level;
   node *cur = r;
   while (level--) {
     node *pre = cur;
-    cur = node_descend(cur, key, len);
+    cur = descend_with_hint(h, cur, key, len);
     // TODO: remove this
     assert(pre && pre->level);
     path_push_node(p, pre);
@@ -244,129 +487,430 @@ static void descend_to_leaf_single(node *r, batch *b, worker *w, uint32_t kidx,
   path_push_node(p, cur);
 }
 
-// this function is used for lazy descending, for key range [key_a, key_b],
-// if path a and path b falls into the same leaf node, all the keys between them
-// must fall into the same leaf node since they are sorted,
+// this function is used for lazy descending, for path range [path_a, path_b],
+// if path a and path b falls into the same leaf node, all the paths between them
+// must fall into the same leaf node since their keys are sorted,
 // so we can avoid descending for each key, this is especially useful
 // when the palm tree is small or the key is close to each other
 // TODO: use loop to replace recursion
-static void descend_for_range(node *r, batch *b, worker *w, uint32_t kbeg, uint32_t kend, uint32_t pidx)
+static void descend_for_range(node *r, batch *b, worker *w, uint32_t pbeg, uint32_t pend, descend_hint *h)
 {
-  if ((kbeg + 1) >= kend) return ;
+  if ((pbeg + 1) >= pend) return ;
 
-  path *lp = worker_get_path_at(w, pidx);
-  path *rp = worker_get_path_at(w, pidx + kend - kbeg);
+  path *lp = worker_get_path_at(w, pbeg);
+  path *rp = worker_get_path_at(w, pend);
   if (path_get_node_at_level(lp, 0) != path_get_node_at_level(rp, 0)) {
-    uint32_t kmid = (kbeg + kend) / 2;
-    descend_to_leaf_single(r, b, w, kmid, pidx + kmid - kbeg);
-    descend_for_range(r, b, w, kbeg, kmid, pidx);
-    descend_for_range(r, b, w, kmid, kend, pidx + kmid - kbeg);
+    uint32_t pmid = (pbeg + pend) / 2;
+    descend_to_leaf_single(r, b, w, pmid, h);
+    descend_for_range(r, b, w, pbeg, pmid, h);
+    descend_for_range(r, b, w, pmid, pend, h);
   } else {
-    // all the keys in [kbeg, kend] fall into the same leaf node,
-    // they must all have the exact same path, so copy path for keys in (kbeg, kend)
-    uint32_t between = kend - kbeg - 1;
-    for (uint32_t i = 1; i <= between; ++i)
-      path_copy(lp, worker_get_path_at(w, pidx + i));
+    // all the paths in [pbeg, pend] fall into the same leaf node,
+    // they must all have the exact same path, so copy path for paths in (pbeg, pend)
+    for (uint32_t i = pbeg + 1; i < pend; ++i)
+      path_copy(lp, worker_get_path_at(w, i));
+  }
+}
+
+// descend to leaf level by level for `number` paths, every path already has root `r` in it,
+// `zigzag` means we change direction at each level so that we process each key from left to right
+// in level 0 for better cache locality
+static void descend_by_level(node *r, batch *b, uint32_t number, worker *w, int zigzag, descend_hint *h)
+{
+  // 1 means left to right, -1 means right to left
+  int direction = (!zigzag || (r->level % 2) == 0) ? 1 : -1;
+  for (uint32_t level = r->level, idx = 0; level; --level, ++idx) {
+    int j, e;
+    if (direction == 1)
+      j = 0, e = (int)number;
+    else
+      j = (int)number - 1, e = -1;
+    for (; j != e; j += direction) {
+      path *p = worker_get_path_at(w, (uint32_t)j);
+      uint32_t  op;
+      void    *key;
+      uint32_t len;
+      void    *val;
+      // get kv info
+      batch_read_at(b, path_get_kv_id(p), &op, &key, &len, &val);
+      node *cur = path_get_node_at_index(p, idx);
+      cur = descend_with_hint(h, cur, key, len);
+      node_prefetch(cur);
+      path_push_node(p, cur);
+    }
+    if (zigzag) direction *= -1;
+  }
+}
+
+// return the leaf node that key at `kidx` falls in
+static node* leaf_of_key(node *r, batch *b, uint32_t kidx)
+{
+  uint32_t  op;
+  void    *key;
+  uint32_t len;
+  void    *val;
+  batch_read_at(b, kidx, &op, &key, &len, &val);
+
+  node *cur = r;
+  while (cur->level)
+    cur = node_descend(cur, key, len);
+  return cur;
+}
+
+// move slice boundary `k` forward to the first key that is not in the same leaf as key `k - 1`,
+// since keys are sorted, we do an exponential search and then a binary search on leaf nodes,
+// every worker computes the same boundary for the same `k`, so no communication is needed
+static uint32_t leaf_boundary(node *r, batch *b, uint32_t k)
+{
+  uint32_t keys = batch_get_keys(b);
+  if (k == 0 || k >= keys) return k;
+
+  node *leaf = leaf_of_key(r, b, k - 1);
+
+  // keys in [k, lo) are all in `leaf`, key at `hi` is not (or `hi` is the end)
+  uint32_t lo = k, hi = k, step = 1;
+  while (hi < keys && leaf_of_key(r, b, hi) == leaf) {
+    lo = hi + 1;
+    hi = lo + step;
+    step <<= 1;
+  }
+  if (hi > keys) hi = keys;
+
+  while (lo < hi) {
+    uint32_t mid = (lo + hi) / 2;
+    if (leaf_of_key(r, b, mid) == leaf)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+// descend `descend_samples` evenly spaced paths in [0, number) (including both ends) lazily,
+// if most of the neighbour samples land in the same leaf, keys are close to each other,
+// so lazy descend can copy most of the paths, otherwise zigzag descend is better,
+// return 1 if lazy descend is chosen, samples are kept in paths
+#define descend_samples 8
+static int descend_sample(node *r, batch *b, uint32_t number, worker *w, uint32_t *sample,
+  descend_hint *h)
+{
+  uint32_t last = number - 1, same = 0;
+  for (uint32_t i = 0; i < descend_samples; ++i) {
+    sample[i] = (uint32_t)((uint64_t)last * i / (descend_samples - 1));
+    if (i && sample[i] == sample[i - 1]) {
+      ++same;
+      continue;
+    }
+    descend_to_leaf_single(r, b, w, sample[i], h);
+    if (i && path_get_node_at_level(worker_get_path_at(w, sample[i]), 0) ==
+             path_get_node_at_level(worker_get_path_at(w, sample[i - 1]), 0))
+      ++same;
+  }
+
+  if (same * 2 >= descend_samples - 1)
+    return 1;
+
+  for (uint32_t i = 0; i < descend_samples; ++i)
+    path_clear(worker_get_path_at(w, sample[i]));
+  return 0;
+}
+
+// give each run of equal keys in [beg, end) one path, since they descend to the same leaf,
+// kvs in a run are executed one by one in the order they are added to the batch,
+// return number of paths
+static uint32_t assign_paths(batch *b, uint32_t beg, uint32_t end, worker *w)
+{
+  uint32_t  op, plen = 0;
+  void    *key, *pkey = 0;
+  uint32_t len;
+  void    *val;
+  uint32_t number = 0;
+  path *p = 0;
+  for (uint32_t i = beg; i < end; ++i) {
+    batch_read_at(b, i, &op, &key, &len, &val);
+    if (p && path_get_kv_run(p) < max_kv_run && compare_key(key, len, pkey, plen) == 0) {
+      path_extend_kv_run(p);
+      continue;
+    }
+    p = worker_get_new_path(w);
+    path_set_kv_id(p, i);
+    pkey = key;
+    plen = len;
+    ++number;
   }
+  return number;
 }
-#endif /* Lazy */
 
 // we descend to leaf node for each key in [beg, end), and store each key's descending path.
 // there are 3 descending policy to choose:
 //   1. lazy descend: like dfs, but with some amazing optimization, great for sequential insertion
 //   2. level descend: like bfs, good for cache locality
 //   3. zigzag descend: invented by myself, also good for cache locality
-static void descend_to_leaf(palm_tree *pt, batch *b, uint32_t beg, uint32_t end, worker *w)
+// and an adaptive policy which samples the keys and chooses between lazy and zigzag for each batch
+static void descend_to_leaf(palm_tree *pt, node *r, batch *b, uint32_t beg, uint32_t end, worker *w)
 {
   if (beg == end) return ;
 
-#ifdef Lazy  // lazy descend
-  for (uint32_t i = beg; i < end; ++i) {
-    path* p = worker_get_new_path(w);
-    path_set_kv_id(p, i);
+  uint32_t number = assign_paths(b, beg, end, w);
+
+  descend_hint h;
+  descend_hint_init(&h, b);
+
+  uint32_t policy = __atomic_load_n(&pt->descend, __ATOMIC_RELAXED);
+
+  if (policy == DescendAdaptive) {
+    uint32_t sample[descend_samples];
+    if (descend_sample(r, b, number, w, sample, &h)) {
+      for (uint32_t i = 1; i < descend_samples; ++i)
+        descend_for_range(r, b, w, sample[i - 1], sample[i], &h);
+      return ;
+    }
+    policy = DescendZigzag;
   }
 
-  uint32_t pidx = 0;
-  descend_to_leaf_single(pt->root, b, w, beg, pidx);
-  if (--end > beg) {
-    descend_to_leaf_single(pt->root, b, w, end, pidx + end - beg);
-    descend_for_range(pt->root, b, w, beg, end, pidx);
+  if (policy == DescendLazy) {
+    descend_to_leaf_single(r, b, w, 0, &h);
+    if (number > 1) {
+      descend_to_leaf_single(r, b, w, number - 1, &h);
+      descend_for_range(r, b, w, 0, number - 1, &h);
+    }
+    return ;
   }
-#elif Level  // level descend
-  for (uint32_t i = beg; i < end; ++i) {
-    path* p = worker_get_new_path(w);
-    path_set_kv_id(p, i);
-    path_push_node(p, pt->root);
+
+  for (uint32_t i = 0; i < number; ++i)
+    path_push_node(worker_get_path_at(w, i), r);
+
+  descend_by_level(r, b, number, w, policy == DescendZigzag, &h);
+}
+
+// descend to leaf from root `r` for the keys of this worker's slice of `b`, `b` must be sorted
+static void descend_slice(palm_tree *pt, node *r, batch *b, worker *w)
+{
+  // calculate [beg, end) in a batch that current thread needs to process
+  // it's possible that a worker has no key to process
+  uint32_t keys = batch_get_keys(b);
+  uint32_t part = (uint32_t)ceilf((float)keys / w->total);
+  uint32_t beg = w->id * part > keys ? keys : w->id * part;
+  uint32_t end = beg + part > keys ? keys : beg + part;
+
+  // cut the slice at leaf boundaries, so that workers own disjoint leaf nodes from the start
+  // and there is (almost) nothing to redistribute in stage 2,
+  // read only batch does not modify the tree, workers can share leaf nodes
+  if (!batch_is_read_only(b)) {
+    beg = leaf_boundary(r, b, beg);
+    end = leaf_boundary(r, b, end);
   }
 
-  for (uint32_t level = pt->root->level, idx = 0; level; --level, ++idx) {
-    for (uint32_t i = beg, j = 0; i < end; ++i, ++j) {
-      uint32_t  op;
-      void    *key;
-      uint32_t len;
-      void    *val;
-      // get kv info
-      batch_read_at(b, i, &op, &key, &len, &val);
-      path *p = worker_get_path_at(w, j);
-      node *cur = path_get_node_at_index(p, idx);
-      cur = node_descend(cur, key, len);
-      node_prefetch(cur);
-      path_push_node(p, cur);
+  descend_to_leaf(pt, r, b, beg, end, w);
+}
+
+/**
+ *   batches are pipelined, when all the workers have arrived at the last barrier of a batch that
+ *   modifies branch nodes, only the root is left to worker 0, the other workers descend for the next
+ *   batch in the queue (if any) in the meantime, which saves the descent after the batch is done.
+ *
+ *   the root may still split or shrink, so we remember `root_epoch` we start with, the next batch
+ *   uses the paths only if the epoch is unchanged, otherwise it descends again, old roots are not
+ *   freed until the end of the batch, so reading them ahead is safe.
+**/
+static void descend_ahead(palm_tree *pt, worker *w, uint64_t nth)
+{
+  // `nth` is the position of the next batch in the queue
+  batch *next = (batch *)bounded_queue_peek_at(pt->queue, nth);
+  if (next == 0 || batch_is_unsorted(next)) return ;
+
+  struct clock c = clock_get();
+  // pair with worker 0 that publishes the root before it bumps the epoch
+  uint32_t epoch = __atomic_load_n(&pt->root_epoch, __ATOMIC_ACQUIRE);
+  node *root = __atomic_load_n(&pt->root, __ATOMIC_ACQUIRE);
+
+  worker_reset_paths(w);
+  descend_slice(pt, root, next, w);
+  w->ahead_nth = nth + 1;
+  w->ahead_epoch = epoch;
+  update_metric(w->id, stage_ahead, &c);
+}
+
+/**
+ *   combining tree barrier, worker i reports to worker (i - lowbit(i)) once all its children
+ *   i + 1, i + 2, i + 4, ... (below lowbit(i)) have reported, so worker 0 knows everybody has arrived
+ *   after log(P) rounds, then it releases all the workers at once through `barrier_gen`.
+ *
+ *   if `gather` is set, fences of `level` are merged into the parent on the way up, worker 0 ends up
+ *   with all of them and grows or shrinks the root before others are released.
+ *
+ *   if `ahead` is not 0, it's the queue position of the next batch, worker 0 tells the others through
+ *   `stable_gen` once everybody has arrived, then they descend for that batch while it handles the root,
+ *   or after they are released if they miss it.
+ *
+ *   waiters spin for a while and then park, children on their parent's `wake`, others on `barrier_gen`,
+ *   or on `stable_gen` if they are going to descend ahead
+**/
+static void palm_tree_combine(palm_tree *pt, worker *w, int gather, uint32_t level, uint64_t ahead)
+{
+  // every worker goes through the same barriers, so `epoch` is the same in all of them
+  uint32_t epoch = ++w->epoch;
+
+  for (uint32_t s = 1; s < w->total; s <<= 1) {
+    if (w->id & s) {
+      worker_arrive(w, pt->workers[w->id - s], epoch);
+      break;
+    }
+    if (w->id + s < w->total) {
+      worker *child = pt->workers[w->id + s];
+      worker_wait_arrival(w, child, epoch);
+      if (gather)
+        worker_merge_fences(w, child, level);
     }
   }
-#else  // zigzag descend
-  for (uint32_t i = beg; i < end; ++i) {
-    path* p = worker_get_new_path(w);
-    path_set_kv_id(p, i);
-    path_push_node(p, pt->root);
+
+  if (w->id == 0) {
+    if (ahead) {
+      __atomic_store_n(&pt->stable_gen, epoch, __ATOMIC_RELEASE);
+      __atomic_thread_fence(__ATOMIC_SEQ_CST);
+      if (__atomic_load_n(&pt->barrier_wait, __ATOMIC_RELAXED))
+        worker_unpark(&pt->stable_gen, 1 /* all */);
+#ifdef Test
+      // give the others a chance to descend from the old root, so that stale paths are exercised
+      sched_yield();
+#endif
+    }
+    if (gather)
+      handle_root_split(pt, w);
+    __atomic_store_n(&pt->barrier_gen, epoch, __ATOMIC_RELEASE);
+    // pair with the fence below, either we see the sleeper or it sees the new generation
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&pt->barrier_wait, __ATOMIC_RELAXED))
+      worker_unpark(&pt->barrier_gen, 1 /* all */);
+    return ;
   }
 
-  // make sure that we process each key from left to right in level 0 for better cache locality
-  // 1 means left to right, -1 means right to left
-  int direction = ((pt->root->level % 2) == 0) ? 1 : -1;
-  for (uint32_t level = pt->root->level, idx = 0; level; --level, ++idx, direction *= -1) {
-    int i, e, j;
-    if (direction == 1)
-      i = beg, e = end, j = 0;
-    else
-      i = end - 1, e = (int)beg - 1, j = end - beg - 1;
-    for (; i != e; i += direction, j += direction) {
-      uint32_t  op;
-      void    *key;
-      uint32_t len;
-      void    *val;
-      // get kv info
-      batch_read_at(b, (uint32_t)i, &op, &key, &len, &val);
-      path *p = worker_get_path_at(w, (uint32_t)j);
-      node *cur = path_get_node_at_index(p, idx);
-      cur = node_descend(cur, key, len);
-      node_prefetch(cur);
-      path_push_node(p, cur);
+  uint32_t spin = __atomic_load_n(&w->spin, __ATOMIC_RELAXED), spun = 0, gen;
+  while ((gen = __atomic_load_n(&pt->barrier_gen, __ATOMIC_ACQUIRE)) != epoch) {
+    uint32_t *word = &pt->barrier_gen, val = gen;
+    if (ahead) {
+      // pair with worker 0, levels below root are final once we see the new generation
+      uint32_t stable = __atomic_load_n(&pt->stable_gen, __ATOMIC_ACQUIRE);
+      if (stable == epoch) {
+        descend_ahead(pt, w, ahead);
+        ahead = 0;
+        continue;
+      }
+      word = &pt->stable_gen;
+      val = stable;
+    }
+    if (spun < spin) {
+      ++spun;
+      cpu_relax();
+      continue;
     }
+    __atomic_add_fetch(&pt->barrier_wait, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    worker_park(word, val);
+    __atomic_sub_fetch(&pt->barrier_wait, 1, __ATOMIC_RELAXED);
   }
-#endif
+
+  // released before we get to it, the whole tree is final now, still worth doing before the scans
+  if (ahead)
+    descend_ahead(pt, w, ahead);
+}
+
+// global barrier for stage 0, read only batch and the end of a batch, `worker_sync` can not be used
+// here since its channel is indexed by level and it takes P steps to go through all the workers
+static inline void palm_tree_barrier(palm_tree *pt, worker *w)
+{
+  palm_tree_combine(pt, w, 0 /* gather */, 0 /* level */, 0 /* ahead */);
+}
+
+// sort an unsorted batch with all the workers:
+//   1. each worker counts the first key byte of its part of the batch
+//   2. each worker scatters its part to the shared buffer according to the global bucket offset
+//   3. buckets are split among workers by position, each worker sorts the buckets it owns
+static void sort_batch(palm_tree *pt, batch *b, worker *w)
+{
+  uint32_t keys = batch_get_keys(b);
+  uint32_t part = (uint32_t)ceilf((float)keys / w->total);
+  uint32_t beg = w->id * part > keys ? keys : w->id * part;
+  uint32_t end = beg + part > keys ? keys : beg + part;
+
+  // nobody touches the buffer before the barrier below
+  if (w->id == 0 && pt->sort_cap < batch_sort_buffer(keys)) {
+    pt->sort_cap = batch_sort_buffer(keys);
+    free((void *)pt->sort_buf);
+    pt->sort_buf = (uint32_t *)malloc(sizeof(uint32_t) * pt->sort_cap);
+  }
+
+  batch_radix_count(b, beg, end, w->radix);
+
+  palm_tree_barrier(pt, w);
+
+  // bucket start of the whole batch and of this worker
+  uint32_t start[radix_buckets + 1], offset[radix_buckets];
+  start[0] = 0;
+  for (uint32_t i = 0; i < radix_buckets; ++i) {
+    uint32_t sum = 0;
+    for (uint32_t j = 0; j < w->total; ++j) {
+      if (j == w->id) offset[i] = start[i] + sum;
+      sum += pt->workers[j]->radix[i];
+    }
+    start[i + 1] = start[i] + sum;
+  }
+
+  batch_radix_scatter(b, beg, end, offset, pt->sort_buf);
+
+  palm_tree_barrier(pt, w);
+
+  // bucket belongs to the worker whose part contains the bucket start
+  for (uint32_t i = 0; i < radix_buckets; ++i)
+    if (start[i] >= beg && start[i] < end)
+      batch_radix_sort(b, pt->sort_buf, start[i], start[i + 1], i);
+
+  palm_tree_barrier(pt, w);
 }
 
 // Reference: Parallel Architecture-Friendly Latch-Free Modifications to B+ Trees on Many-Core Processors
-// this is the entrance for all the write/read operations
-static void do_palm_tree_execute(palm_tree *pt, batch *b, worker *w)
+// this is the entrance for all the write/read/delete/scan operations, `nth` is the position of
+// this batch in the queue, it is the same for all the workers
+static void do_palm_tree_execute(palm_tree *pt, batch *b, worker *w, uint64_t nth)
 {
   worker_reset(w);
 
+  // paths descended ahead during previous batch are good only if root has not changed since
+  int ahead = w->ahead_nth == nth && w->ahead_epoch == pt->root_epoch;
+  w->ahead_nth = 0;
+  if (!ahead)
+    worker_reset_paths(w);
+
+  // counter of previous batch is not used by anyone now, since there is a global barrier
+  // at the end of each batch
+  if (w->id == 0)
+    __atomic_store_n(&pt->fence_cnt[(nth + 1) % 2], 0, __ATOMIC_RELAXED);
+
   // get root level here to prevent dead lock bug when promoting node modifications
   uint32_t root_level = pt->root->level;
   struct clock c = clock_get();
 
-  /*  ---  Stage 1  --- */
+  /*  ---  Stage 0  --- */
 
-  // calculate [beg, end) in a batch that current thread needs to process
-  // it's possible that a worker has no key to process
-  uint32_t part = (uint32_t)ceilf((float)b->keys / w->total);
-  uint32_t beg = w->id * part > b->keys ? b->keys : w->id * part;
-  uint32_t end = beg + part > b->keys ? b->keys : beg + part;
+  // producer does not sort the batch, so we sort it here
+  if (batch_is_unsorted(b)) {
+    sort_batch(pt, b, w); update_metric(w->id, stage_sort, &c);
+  }
+
+  /*  ---  Stage 1  --- */
 
   // descend to leaf for each key that belongs to this worker in this batch
-  descend_to_leaf(pt, b, beg, end, w); update_metric(w->id, stage_descend, &c);
+  if (!ahead) {
+    descend_slice(pt, pt->root, b, w); update_metric(w->id, stage_descend, &c);
+  }
+
+  // nothing can split or merge, so read the leaves directly and skip all the other stages,
+  // we still need a barrier so that next batch does not modify the tree while we are reading
+  if (batch_is_read_only(b)) {
+    worker_execute_reads(w, b); update_metric(w->id, stage_leaves, &c);
+    palm_tree_barrier(pt, w); update_metric(w->id, stage_barrier, &c);
+    return ;
+  }
 
   worker_sync(w, 0 /* level */, root_level); update_metric(w->id, stage_sync, &c);
 
@@ -380,12 +924,31 @@ static void do_palm_tree_execute(palm_tree *pt, batch *b, worker *w)
   // now we process all the paths that belong to this worker
   worker_execute_on_leaf_nodes(w, b); update_metric(w->id, stage_leaves, &c);
 
-  worker_sync(w, 1 /* level */, root_level); update_metric(w->id, stage_sync, &c);
+  // help previous worker with the leaves it has not touched yet, instead of waiting for it
+  worker_steal_leaf_nodes(w, b); update_metric(w->id, stage_steal, &c);
+
+  // if no leaf splits or merges (e.g. updates, reads, deletes that leave the leaves big enough),
+  // none of the upper levels will change, so there is no need to go through the syncs of all the
+  // levels, root handling and the final global sync, we count the fences with a single barrier
+  // which all the workers agree on
+  uint32_t *fence_cnt = &pt->fence_cnt[nth % 2];
+  __atomic_add_fetch(fence_cnt, w->cur_fence[0], __ATOMIC_RELAXED);
+  palm_tree_barrier(pt, w); update_metric(w->id, stage_barrier, &c);
+
+  if (__atomic_load_n(fence_cnt, __ATOMIC_RELAXED) == 0) {
+    // no leaf is split or merged, recorded leaves are still where the scans start
+    worker_execute_scans(w, b, 0 /* root */); update_metric(w->id, stage_scan, &c);
+    palm_tree_barrier(pt, w); update_metric(w->id, stage_barrier, &c);
+    return ;
+  }
 
   /*  ---  Stage 3  --- */
 
   // fix the split level by level
   uint32_t level = 1;
+  if (level <= root_level) {
+    worker_sync(w, level, root_level); update_metric(w->id, stage_sync, &c);
+  }
   while (level <= root_level) {
     worker_redistribute_work(w, level); update_metric(w->id, stage_redis, &c);
 
@@ -393,6 +956,9 @@ static void do_palm_tree_execute(palm_tree *pt, batch *b, worker *w)
 
     ++level;
 
+    // above root level every worker would have to wait for everyone, leave it to the tree barrier
+    if (level > root_level) break;
+
     worker_sync(w, level, root_level); update_metric(w->id, stage_sync, &c);
 
     // this is a very fucking smart and elegant optimization, we use `level` as an external
@@ -405,10 +971,18 @@ static void do_palm_tree_execute(palm_tree *pt, batch *b, worker *w)
 
   /*  ---  Stage 4  --- */
 
-  if (w->id == 0) {
-    handle_root_split(pt, w); update_metric(w->id, stage_root, &c);
-  }
+  // wait for all the workers and gather the fences of root level to worker 0 on the way,
+  // which handles root split before anyone leaves the barrier, the others descend for the next
+  // batch meanwhile
+  palm_tree_combine(pt, w, 1 /* gather */, root_level, nth); update_metric(w->id, stage_root, &c);
+
+  // all the leaf modifications are done, now we can stream along the leaf chain for scans
+  worker_execute_scans(w, b, pt->root); update_metric(w->id, stage_scan, &c);
+
+  // next batch must not modify the tree while scans are reading it
+  palm_tree_barrier(pt, w); update_metric(w->id, stage_barrier, &c);
 
-  // do a global synchronization, not really needed, but just make things consistent
-  worker_sync(w, level + 1, root_level); update_metric(w->id, stage_sync, &c);
+  // nobody is descending ahead now
+  if (w->id == 0)
+    free_retired_roots(pt);
 }
@@ -13,24 +13,53 @@
 #include "worker.h"
 #include "bounded_queue.h"
 
+// descend policy, see `descend_to_leaf` in palm_tree.c
+#define DescendLazy     0
+#define DescendLevel    1
+#define DescendZigzag   2
+#define DescendAdaptive 3
+
 typedef struct palm_tree
 {
   node *root;
 
   int        worker_num;
   int        running;
+  uint32_t   descend;   // descend policy, can be changed between batches
+  uint32_t   leaf_size;   // node size of level 0
+  uint32_t   branch_size; // node size of the levels above, new node has the size of the node it splits from
   pthread_t *ids;
 
   bounded_queue *queue;
 
   worker **workers;
 
+  uint32_t *sort_buf;      // shared buffer to sort unsorted batch
+  uint32_t  sort_cap;      // number of kv handles `sort_buf` can hold
+  uint32_t  barrier_gen;   // last barrier worker 0 has released
+  uint32_t  barrier_wait;  // number of workers sleeping on `barrier_gen`
+  uint32_t  fence_cnt[2];  // number of fences generated in leaf level, one for each of 2 adjacent batches
+  uint32_t  root_epoch;    // bumped every time root changes, descents ahead of time check it
+  uint32_t  stable_gen;    // last tree barrier after which only the root is going to be modified
+  node     *retired;       // old roots, freed after the batch since descents ahead may still read them
+
 }palm_tree;
 
+// called by worker 0 with the batch and `arg` when the batch is done, it must not block
+// on the palm tree (e.g. execute another batch when the queue is full)
+typedef element_callback batch_callback;
+
 palm_tree* new_palm_tree(int worker_num, int queue_size);
+palm_tree* new_palm_tree_on_cpus(int worker_num, int queue_size, const int *cpus);
 void free_palm_tree(palm_tree *pt);
 void palm_tree_flush(palm_tree *pt);
-void palm_tree_execute(palm_tree *pt, batch *b);
+uint64_t palm_tree_execute(palm_tree *pt, batch *b);
+uint64_t palm_tree_execute_callback(palm_tree *pt, batch *b, batch_callback cb, void *arg);
+int palm_tree_poll(palm_tree *pt, uint64_t ticket);
+void palm_tree_set_descend_policy(palm_tree *pt, uint32_t policy);
+int palm_tree_set_node_size(palm_tree *pt, uint32_t leaf_size, uint32_t branch_size);
+void palm_tree_set_spin(palm_tree *pt, uint32_t spin);
+void palm_tree_wait(palm_tree *pt, uint64_t ticket);
 
 #ifdef Test
 
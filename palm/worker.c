@@ -9,6 +9,14 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#else
+#include <sched.h>
+#endif
 // TODO: remove this
 #include <stdio.h>
 
@@ -43,6 +51,54 @@ typedef struct fence_iter
 void init_fence_iter(fence_iter *iter, worker *w, uint32_t level);
 fence* next_fence(fence_iter *iter);
 
+static fence_chunk* new_fence_chunk()
+{
+  fence_chunk *c = (fence_chunk *)malloc(sizeof(fence_chunk) + fence_chunk_size);
+  assert(c);
+  c->next = 0;
+  c->used = 0;
+  return c;
+}
+
+static void fence_arena_init(fence_arena *a)
+{
+  a->head = new_fence_chunk();
+  a->curr = a->head;
+}
+
+static void fence_arena_free(fence_arena *a)
+{
+  fence_chunk *c = a->head;
+  while (c) {
+    fence_chunk *next = c->next;
+    free((void *)c);
+    c = next;
+  }
+}
+
+// all the keys in arena are discarded, chunks are kept for reuse
+static inline void fence_arena_reset(fence_arena *a)
+{
+  a->curr = a->head;
+  a->curr->used = 0;
+}
+
+// copy `len` bytes of `key` to arena, a new chunk is only allocated when all the chunks are used
+static char* fence_arena_copy(fence_arena *a, const char *key, uint32_t len)
+{
+  fence_chunk *c = a->curr;
+  if (unlikely(c->used + len > fence_chunk_size)) {
+    if (c->next == 0)
+      c->next = new_fence_chunk();
+    c = a->curr = c->next;
+    c->used = 0;
+  }
+  char *ptr = c->data + c->used;
+  memcpy(ptr, key, len);
+  c->used += len;
+  return ptr;
+}
+
 worker* new_worker(uint32_t id, uint32_t total)
 {
   assert(id < total);
@@ -77,6 +133,30 @@ worker* new_worker(uint32_t id, uint32_t total)
   w->fences[0] = (fence *)fences;
   assert(posix_memalign(&fences, 64, sizeof(fence) * w->max_fence) == 0);
   w->fences[1] = (fence *)fences;
+  fence_arena_init(&w->arenas[0]);
+  fence_arena_init(&w->arenas[1]);
+
+  // scan is not so common, 4 is enough
+  w->max_scan = 4;
+  w->cur_scan = 0;
+  void *scans;
+  assert(posix_memalign(&scans, 64, sizeof(pending_scan) * w->max_scan) == 0);
+  w->scans = (pending_scan *)scans;
+
+  w->spin   = default_spin_times;
+  w->wake   = 0;
+  w->parked = 0;
+  w->epoch   = 0;
+  w->arrived = 0;
+  w->claim       = 0;
+  w->claim_epoch = 0;
+  w->leaf_end    = 0;
+  w->ahead_nth   = 0;
+  w->ahead_epoch = 0;
+#ifdef Test
+  w->delay  = 0;
+  w->stolen = 0;
+#endif
 
   w->prev = 0;
   w->next = 0;
@@ -93,6 +173,9 @@ worker* new_worker(uint32_t id, uint32_t total)
 
 void free_worker(worker* w)
 {
+  free((void *)w->scans);
+  fence_arena_free(&w->arenas[1]);
+  fence_arena_free(&w->arenas[0]);
   free((void *)w->fences[1]);
   free((void *)w->fences[0]);
   free((void *)w->paths);
@@ -105,14 +188,88 @@ void worker_link(worker *a, worker *b)
   b->prev = a;
 }
 
-void worker_reset(worker *w)
+void worker_reset_paths(worker *w)
 {
   for (uint32_t i = 0; i < w->cur_path; ++i)
     path_clear(&w->paths[i]);
   w->cur_path = 0;
+}
 
+// paths are not reset here, they may have been descended ahead for this batch
+void worker_reset(worker *w)
+{
   w->cur_fence[0] = 0;
   w->cur_fence[1] = 0;
+  fence_arena_reset(&w->arenas[0]);
+  fence_arena_reset(&w->arenas[1]);
+
+  w->cur_scan = 0;
+}
+
+// takes effect from the next time this worker waits
+void worker_set_spin(worker *w, uint32_t spin)
+{
+  __atomic_store_n(&w->spin, spin, __ATOMIC_RELAXED);
+}
+
+// sleep if `*word` is still `val`, it may return early, so caller needs to check its condition again
+void worker_park(uint32_t *word, uint32_t val)
+{
+#ifdef __linux__
+  syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, val, 0, 0, 0);
+#else
+  (void)word;
+  (void)val;
+  sched_yield();
+#endif
+}
+
+// wake up one or all the threads sleeping on `word`
+void worker_unpark(uint32_t *word, int all)
+{
+#ifdef __linux__
+  syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, all ? INT_MAX : 1, 0, 0, 0);
+#else
+  (void)word;
+  (void)all;
+#endif
+}
+
+// tell `w` that its channel or the arrival of its child has changed, the syscall is made only if `w` is parked
+static void worker_notify(worker *w)
+{
+  __atomic_add_fetch(&w->wake, 1, __ATOMIC_RELEASE);
+  // pair with the fence in `worker_sync`, either we see it parked or it sees the channel change
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&w->parked, __ATOMIC_RELAXED))
+    worker_unpark(&w->wake, 0 /* one, only `w` sleeps on it */);
+}
+
+// report to `parent` in the combining tree that `w` and all its children have arrived at barrier `epoch`
+void worker_arrive(worker *w, worker *parent, uint32_t epoch)
+{
+  __atomic_store_n(&w->arrived, epoch, __ATOMIC_RELEASE);
+  worker_notify(parent);
+}
+
+// wait until `child` reports its arrival at barrier `epoch`, spin for a while and then park
+void worker_wait_arrival(worker *w, worker *child, uint32_t epoch)
+{
+  uint32_t spin = __atomic_load_n(&w->spin, __ATOMIC_RELAXED), spun = 0;
+  while (__atomic_load_n(&child->arrived, __ATOMIC_ACQUIRE) != epoch) {
+    if (spun < spin) {
+      ++spun;
+      cpu_relax();
+      continue;
+    }
+    uint32_t wake = __atomic_load_n(&w->wake, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&w->parked, 1, __ATOMIC_RELAXED);
+    // pair with the fence in `worker_notify`
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&child->arrived, __ATOMIC_RELAXED) != epoch)
+      worker_park(&w->wake, wake);
+    __atomic_store_n(&w->parked, 0, __ATOMIC_RELAXED);
+  }
 }
 
 path* worker_get_new_path(worker *w)
@@ -120,6 +277,8 @@ path* worker_get_new_path(worker *w)
   if (unlikely(w->cur_path == w->max_path)) {
     w->max_path = w->max_path * 2;
     assert(w->paths = (path *)realloc(w->paths, sizeof(path) * w->max_path));
+    for (uint32_t i = w->cur_path; i < w->max_path; ++i)
+      path_clear(&w->paths[i]);
   }
   assert(w->cur_path < w->max_path);
   return &w->paths[w->cur_path++];
@@ -131,9 +290,44 @@ path* worker_get_path_at(worker *w, uint32_t idx)
   return &w->paths[idx];
 }
 
+static void worker_add_scan(worker *w, uint32_t id, node *leaf)
+{
+  if (unlikely(w->cur_scan == w->max_scan)) {
+    w->max_scan = w->max_scan * 2;
+    assert(w->scans = (pending_scan *)realloc(w->scans, sizeof(pending_scan) * w->max_scan));
+  }
+  w->scans[w->cur_scan].id   = id;
+  w->scans[w->cur_scan].leaf = leaf;
+  ++w->cur_scan;
+}
+
 void worker_switch_fence(worker *w, uint32_t level)
 {
   w->cur_fence[level % 2] = 0;
+  fence_arena_reset(&w->arenas[level % 2]);
+}
+
+// copy fence `src` to `dst` which has its own key buffers
+static inline void fence_copy(fence *dst, const fence *src)
+{
+  dst->pth  = src->pth;
+  dst->ptr  = src->ptr;
+  dst->type = src->type;
+  memcpy(dst->key, src->key, src->len);
+  dst->len  = src->len;
+  if (src->olen)
+    memcpy(dst->okey, src->okey, src->olen);
+  dst->olen = src->olen;
+}
+
+// make room for at least `number` fences in both groups, they share `max_fence`
+static void worker_reserve_fence(worker *w, uint32_t number)
+{
+  if (likely(number <= w->max_fence)) return ;
+  while (w->max_fence < number)
+    w->max_fence = w->max_fence * 2;
+  assert(w->fences[0] = (fence *)realloc(w->fences[0], sizeof(fence) * w->max_fence));
+  assert(w->fences[1] = (fence *)realloc(w->fences[1], sizeof(fence) * w->max_fence));
 }
 
 // insert fence info in fence key order for later promotion
@@ -142,10 +336,7 @@ static uint32_t worker_insert_fence(worker *w, uint32_t level, fence *f)
 {
   uint32_t idx = level % 2;
   uint32_t cur = w->cur_fence[idx];
-  if (unlikely(cur == w->max_fence)) {
-    w->max_fence = w->max_fence * 2;
-    assert(w->fences[idx] = (fence *)realloc(w->fences[idx], sizeof(fence) * w->max_fence));
-  }
+  worker_reserve_fence(w, cur + 1);
   assert(cur < w->max_fence);
 
   // find position to insert this fence, avoid fence node duplication
@@ -155,7 +346,8 @@ static uint32_t worker_insert_fence(worker *w, uint32_t level, fence *f)
     if (f->type == fence_replace && f->ptr == fences[i].ptr) {
       // fence type can be fence_insert
       assert(compare_key(fences[i].key, fences[i].len, f->okey, f->olen) == 0);
-      memcpy(fences[i].key, f->key, f->len);
+      // new key may be longer than the old one
+      fences[i].key = fence_arena_copy(&w->arenas[idx], f->key, f->len);
       fences[i].len = f->len;
       return i;
     }
@@ -169,6 +361,8 @@ static uint32_t worker_insert_fence(worker *w, uint32_t level, fence *f)
     memcpy(&fences[l], &fences[l - 1], sizeof(fence));
 
   memcpy(&fences[j], f, sizeof(fence));
+  fences[j].key  = fence_arena_copy(&w->arenas[idx], f->key, f->len);
+  fences[j].okey = f->olen ? fence_arena_copy(&w->arenas[idx], f->okey, f->olen) : 0;
   ++w->cur_fence[idx];
 
   return j;
@@ -183,13 +377,19 @@ static inline void worker_advance_fence(worker *w, uint32_t level, fence *f, uin
   if (i == cur - 1) {
     f->ptr = 0;
   } else {
-    memcpy(f, &w->fences[idx][i + 1], sizeof(fence));
+    fence_copy(f, &w->fences[idx][i + 1]);
   }
 }
 
-static inline uint32_t worker_get_fence_number(worker *w, uint32_t level)
+// find the fence whose node pointer is `n` in fences generated in `level`
+static fence* worker_find_fence(worker *w, uint32_t level, node *n)
 {
-  return w->cur_fence[level % 2];
+  uint32_t idx = level % 2;
+  fence *fences = w->fences[idx];
+  for (uint32_t i = 0; i < w->cur_fence[idx]; ++i)
+    if (fences[i].ptr == n)
+      return &fences[i];
+  return 0;
 }
 
 #ifdef BStar // B* node
@@ -204,20 +404,31 @@ static inline fence* worker_get_last_insert_fence(worker *w)
 }
 #endif // B* node
 
-// loop all the workers to find the fence info for root split, this function should
-// only be called by worker 0
-// TODO: there is only one root split under any circumstances, but looping all the workers
-//       may be an expensive job, especially if this machine supports dozens of threads
-void worker_get_fences(worker *w, uint32_t level, fence **fences, uint32_t *number)
+// merge the sorted fences of `level` in `child` into the sorted fences of `w` from the back,
+// fence keys stay in `child`'s arena, which is not reset until `child` starts next batch,
+// it's only used for root level where there is no replace fence
+void worker_merge_fences(worker *w, worker *child, uint32_t level)
 {
-  assert(w->id == 0);
   uint32_t idx = level % 2;
-  worker *next = w->next;
-  while (next) {
-    for (uint32_t i = 0; i < next->cur_fence[idx]; ++i)
-      worker_insert_fence(w, level, &next->fences[idx][i]);
-    next = next->next;
+  uint32_t m = w->cur_fence[idx], n = child->cur_fence[idx];
+  if (n == 0) return ;
+
+  worker_reserve_fence(w, m + n);
+  fence *a = w->fences[idx], *b = child->fences[idx];
+  int i = (int)m - 1, j = (int)n - 1, k = (int)(m + n) - 1;
+  while (j >= 0) {
+    if (i >= 0 && compare_key(a[i].key, a[i].len, b[j].key, b[j].len) > 0)
+      memcpy(&a[k--], &a[i--], sizeof(fence));
+    else
+      memcpy(&a[k--], &b[j--], sizeof(fence));
   }
+  w->cur_fence[idx] = m + n;
+}
+
+// fences of `level` in `w`, for worker 0 they are all the fences after they are merged up the tree
+void worker_get_fences(worker *w, uint32_t level, fence **fences, uint32_t *number)
+{
+  uint32_t idx = level % 2;
   *number = w->cur_fence[idx];
   *fences = w->fences[idx];
 }
@@ -300,14 +511,17 @@ void worker_sync(worker *w, uint32_t level, uint32_t root_level)
   }
 
   int idx = level;
+  uint32_t spin = __atomic_load_n(&w->spin, __ATOMIC_RELAXED), spun = 0;
   while (!(set_first && set_last && their_first && their_last)) {
     if (my_first && !set_first) {
       __atomic_store(&w->prev->first[idx], &my_first, __ATOMIC_RELAXED);
+      worker_notify(w->prev);
       set_first = 1;
     }
 
     if (my_last && !set_last) {
       __atomic_store(&w->next->last[idx], &my_last, __ATOMIC_RELAXED);
+      worker_notify(w->next);
       set_last = 1;
     }
 
@@ -324,6 +538,28 @@ void worker_sync(worker *w, uint32_t level, uint32_t root_level)
       my_last = their_last;
 
     __atomic_thread_fence(__ATOMIC_ACQ_REL);
+
+    // anything left to publish is done in next round without waiting
+    if ((my_first && !set_first) || (my_last && !set_last) ||
+        (set_first && set_last && their_first && their_last))
+      continue;
+
+    if (spun < spin) {
+      ++spun;
+      cpu_relax();
+      continue;
+    }
+
+    // we have spun enough, sleep until a neighbour writes our channel
+    uint32_t wake = __atomic_load_n(&w->wake, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&w->parked, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    node *first = 0, *last = 0;
+    __atomic_load(&w->first[idx], &first, __ATOMIC_RELAXED);
+    __atomic_load(&w->last[idx], &last, __ATOMIC_RELAXED);
+    if ((their_first || !first) && (their_last || !last))
+      worker_park(&w->wake, wake);
+    __atomic_store_n(&w->parked, 0, __ATOMIC_RELAXED);
   }
 
   // we can safely reset since this level's synchronization is done
@@ -421,6 +657,31 @@ void worker_redistribute_work(worker *w, uint32_t level)
 }
 
 #ifdef BStar // B* node
+static int worker_claim_next_leaf(worker *w, node *next);
+
+// whether `curr` is `cn` or a node split from `cn` in this batch
+static int worker_cursor_in_node(worker *w, node *curr, node *cn)
+{
+  for (node *n = cn; n; n = n->next) {
+    if (n == curr)
+      return 1;
+    if (n != cn && !worker_find_fence(w, 0, n))
+      return 0;
+  }
+  return 0;
+}
+
+// the old fence key of `next` is its first key unless some keys in it are deleted,
+// so we get the real one from parent, if `next` has been adjusted in this batch,
+// its first key is the fence key we are going to replace, no need to do so
+static void worker_get_replace_key(worker *w, node *parent, node *next, fence *fnc)
+{
+  if (worker_find_fence(w, 0, next))
+    return ;
+
+  assert(node_get_child_key(parent, next, fnc->okey, &fnc->olen));
+}
+
 // try to move some key to next node if all of below situations are satisfied
 //   1. next node does not belong to next worker
 //   2. next node share the same parent with this node
@@ -428,13 +689,19 @@ void worker_redistribute_work(worker *w, uint32_t level)
 // and then insert k-v pair
 // for now we pessimisticly assume that `w->last`'s next node belongs to next worker,
 // because it's a little bit hard to determine whether next node belongs to next worker,
-// so use `*curr != w->my_last` instead
+// so `w->my_last` and nodes split from it never move keys to next node
 // TODO: get the real next worker's first node
 static int worker_handle_full_leaf_node(worker *w, node **curr, path *cp, fence *fnc,
   const void *key, uint32_t len, void *val)
 {
   node *next = (*curr)->next;
-  if (unlikely(*curr == w->my_last || next == 0 || path_get_level(cp) == 1))
+  if (unlikely(next == 0 || next->keys == 0 || path_get_level(cp) == 1))
+    return 0;
+  // node after `w->my_last` belongs to next worker, even if `w->my_last` has been split
+  if (unlikely(worker_cursor_in_node(w, *curr, w->my_last)))
+    return 0;
+  // `next` may be stolen by next worker
+  if (unlikely(!worker_claim_next_leaf(w, next)))
     return 0;
 
   node *parent = path_get_node_at_level(cp, 1);
@@ -449,10 +716,11 @@ static int worker_handle_full_leaf_node(worker *w, node **curr, path *cp, fence
   if (unlikely(r == 0)) {
     // `next` does not have enough room, we move
     // 1/3 key of `curr` and 1/3 key of `next` into a new node
-    node *nn = new_node(Leaf, 0);
+    node *nn = new_node_with_size(Leaf, 0, node_get_size(*curr));
     char nkey[max_key_size];
     uint32_t nlen;
     node_adjust_many(nn, *curr, next, fnc->okey, &fnc->olen, fnc->key, &fnc->len, nkey, &nlen);
+    worker_get_replace_key(w, parent, next, fnc);
     // there are 2 fence key, this is for replace
     fnc->pth = cp;
     fnc->ptr = next; // store `next` for verification
@@ -470,6 +738,7 @@ static int worker_handle_full_leaf_node(worker *w, node **curr, path *cp, fence
   } else {
     // `next` have free space, now we can avoid splitting the node
     // record information to replace fence key in parent
+    worker_get_replace_key(w, parent, next, fnc);
     fnc->pth = cp;
     fnc->ptr = next; // store `next` for verification
     fnc->type = fence_replace;
@@ -482,7 +751,6 @@ static int worker_handle_full_leaf_node(worker *w, node **curr, path *cp, fence
   }
   assert(node_insert(*curr, key, len, (const void *)*(val_t *)val) == 1);
 
-  // set_val(val, 1);
   return 1;
 }
 #endif // BStar
@@ -496,7 +764,7 @@ static int worker_handle_full_leaf_node(worker *w, node **curr, path *cp, fence
 static void worker_handle_leaf_node_split(worker *w, node **curr, path *cp, fence *fnc,
   const void *key, uint32_t len, void *val)
 {
-  node *nn = new_node(Leaf, 0);
+  node *nn = new_node_with_size(Leaf, 0, node_get_size(*curr));
   fnc->pth = cp;
   fnc->ptr = nn;
   fnc->type = fence_insert;
@@ -532,17 +800,333 @@ static void worker_handle_leaf_node_split(worker *w, node **curr, path *cp, fenc
   }
 
   assert(node_insert(*curr, key, len, (const void *)*(val_t *)val) == 1);
-  // set_val(val, 1);
+}
+
+// merge `right` into `left`, they must be children of the node at `level` + 1 in path `cp`,
+// if succeed, record a delete fence for `right` and free it, return 1, else return 0
+static int worker_merge_node(worker *w, uint32_t level, path *cp, node *left, node *right)
+{
+  fence f;
+  char key[max_key_size];
+  uint32_t len;
+  node *parent = path_get_node_at_level(cp, level + 1);
+  // `right` may be the first child of next parent
+  if (node_get_child_key(parent, right, key, &len) == 0)
+    return 0;
+
+  if (node_merge(left, right, key, len) == 0)
+    return 0;
+
+  f.pth  = cp;
+  f.ptr  = right; // store `right` for verification
+  f.type = fence_delete;
+  f.key  = key;
+  f.len  = len;
+  f.okey = 0;
+  f.olen = 0;
+  worker_insert_fence(w, level, &f);
+
+  // scans start from `right` now start from `left`
+  if (level == 0)
+    for (uint32_t i = 0; i < w->cur_scan; ++i)
+      if (w->scans[i].leaf == right)
+        w->scans[i].leaf = left;
+
+  free_node(right);
+  return 1;
+}
+
+// called when this worker finishes all the modification on node `n`, if `n` or its neighbour is underfull,
+// try to merge them, `left` is the last node this worker finished in this level, `upcoming` is the next
+// node this worker is going to modify. these nodes can not be merged:
+//   1. node belongs to other workers
+//   2. node generated in this level
+//   3. node has a different parent
+static void worker_try_merge_node(worker *w, worker *owner, uint32_t level, path *cp, node **left, node *n,
+  node *upcoming)
+{
+  // root has no neighbour
+  if (path_get_level(cp) <= level + 1) {
+    *left = n;
+    return ;
+  }
+
+  // we don't know whether next node of `owner->my_last` belongs to next worker, so we don't touch it,
+  // unless this is the last worker, `owner` is the worker `n` is assigned to, it may be stolen by `w`
+  int last = n == owner->my_last && owner->id != owner->total - 1;
+
+  if (*left && (*left)->next == n && worker_find_fence(w, level, n) == 0 &&
+     (node_is_underfull(*left) || node_is_underfull(n)) && worker_merge_node(w, level, cp, *left, n))
+    n = *left;
+
+  node *next;
+  while (!last && (next = n->next) && next != upcoming &&
+    worker_find_fence(w, level, next) == 0 && (node_is_underfull(n) || node_is_underfull(next)) &&
+    worker_merge_node(w, level, cp, n, next)) ;
+
+  *left = n;
+}
+
+// look up `key` in leaf `n` and set the result of kv `id`
+static void worker_read_leaf(batch *b, uint32_t id, node *n, const void *key, uint32_t len, void *val)
+{
+  val_t *ptr = node_search_value_ptr(n, key, len);
+  if (ptr) {
+    set_val(val, *ptr);
+    batch_set_result_at(b, id, Found, (const void *)*ptr);
+  } else {
+    set_val(val, 0);
+    batch_set_result_at(b, id, NotFound, 0);
+  }
+}
+
+/**
+ *   leaf work stealing, leaf nodes a worker is assigned are split into groups of paths landing in the
+ *   same leaf, `claim` holds the groups nobody has taken, owner takes them one by one from the head,
+ *   when a worker finishes its own leaves, it steals groups from the tail of its previous worker,
+ *   so fences of stolen leaves are still smaller than fences of the thief's own leaves, and all the
+ *   fences are in worker order as if nothing is stolen.
+ *
+ *   a stolen leaf is modified without touching its neighbours except empty nodes on its right, so no
+ *   B* adjustment into next node and no merge with left node.
+ *
+ *   a worker whose paths spill into next worker's paths can not be stolen from, since its leaves
+ *   after the spill would come after the stolen ones.
+**/
+
+#define claim_make(head, tail) (((uint64_t)(tail) << 32) | (uint64_t)(head))
+#define claim_head(c) ((uint32_t)(c))
+#define claim_tail(c) ((uint32_t)((c) >> 32))
+
+// end of the leaf group starting at path `i`
+static uint32_t worker_group_end(worker *w, uint32_t i)
+{
+  node *n = path_get_node_at_level(&w->paths[i], 0);
+  for (++i; i < w->leaf_end && path_get_node_at_level(&w->paths[i], 0) == n; ++i) ;
+  return i;
+}
+
+// publish the leaf groups this worker is going to modify so that next worker can steal them
+static void worker_open_leaf_groups(worker *w)
+{
+  w->leaf_end = w->beg_path + w->tot_path;
+  // leaves after the spill can not be stolen, so nothing can be stolen
+  uint32_t tail = w->leaf_end <= w->cur_path ? w->leaf_end : w->beg_path;
+  __atomic_store_n(&w->claim, claim_make(w->beg_path, tail), __ATOMIC_RELAXED);
+  __atomic_store_n(&w->claim_epoch, w->epoch, __ATOMIC_RELEASE);
+}
+
+// owner takes the leaf group starting at path `i`, return 0 if it's stolen
+static int worker_claim_leaf_group(worker *w, uint32_t i)
+{
+  uint64_t c = __atomic_load_n(&w->claim, __ATOMIC_RELAXED);
+  // already taken by owner, or the worker can not be stolen from
+  if (i < claim_head(c) || claim_head(c) == claim_tail(c))
+    return i < claim_head(c) || w->leaf_end > w->cur_path;
+
+  assert(i == claim_head(c));
+  uint32_t end = worker_group_end(w, i);
+  // only owner changes head, so only thief can fail this
+  while (claim_tail(c) >= end) {
+    if (__atomic_compare_exchange_n(&w->claim, &c, claim_make(end, claim_tail(c)), 0,
+        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+      return 1;
+  }
+  return 0;
+}
+
+#ifdef BStar
+// `next` is the node after the leaf `w` is modifying, it can be moved keys into only if `w` owns it,
+// it's either an empty node between two leaf groups or the leaf of the next group
+static int worker_claim_next_leaf(worker *w, node *next)
+{
+  if (w->leaf_end > w->cur_path)
+    return 1;
+  uint32_t head = claim_head(__atomic_load_n(&w->claim, __ATOMIC_RELAXED));
+  if (head == w->leaf_end || path_get_node_at_level(&w->paths[head], 0) != next)
+    return 1;
+  return worker_claim_leaf_group(w, head);
+}
+#endif
+
+// state carried from one path to the next when modifying leaf nodes
+typedef struct leaf_cursor
+{
+  fence  fnc;
+  char   fkey[max_key_size];
+  char   fokey[max_key_size];
+  node  *pn;        // previous path node
+  path  *pp;        // previous path
+  node  *ln;        // last leaf node we finished
+  node  *curr;      // node actually to process the key
+  int    move_left;
+  int    stolen;    // leaf is stolen from previous worker
+}leaf_cursor;
+
+static void leaf_cursor_init(leaf_cursor *lc, int stolen)
+{
+  lc->fnc.ptr  = 0;
+  lc->fnc.key  = lc->fkey;
+  lc->fnc.okey = lc->fokey;
+  lc->fnc.olen = 0;
+  lc->pn   = 0;
+  lc->pp   = 0;
+  lc->ln   = 0;
+  lc->curr = 0;
+  lc->move_left = 0;
+  lc->stolen = stolen;
+}
+
+// insert the kv of path `cp` into current leaf node, split the node if it is full,
+// return pointer to the value if key already exists, otherwise return 0
+static val_t* worker_insert_leaf(worker *w, leaf_cursor *lc, path *cp, const void *key, uint32_t len, void *val)
+{
+  switch (node_insert(lc->curr, key, len, (const void *)*(val_t *)val)) {
+  case 1:  // key insert succeed
+    return 0;
+  case 0: { // key already exists
+    val_t *ptr = node_search_value_ptr(lc->curr, key, len);
+    assert(ptr);
+    return ptr;
+  }
+  case -1: // node does not have enough space
+    #ifdef BStar // B* node
+    if (!lc->stolen && worker_handle_full_leaf_node(w, &lc->curr, cp, &lc->fnc, key, len, val))
+      return 0;
+    #endif // BStar
+    // intentionally fall through
+  case -2:
+    worker_handle_leaf_node_split(w, &lc->curr, cp, &lc->fnc, key, len, val);
+    return 0;
+  default:
+    assert(0);
+  }
+  return 0;
+}
+
+// execute kv `id` of path `cp` in current leaf node
+static void worker_execute_on_leaf_kv(worker *w, batch *b, leaf_cursor *lc, path *cp, uint32_t id)
+{
+  uint32_t  op;
+  void    *key;
+  uint32_t len;
+  void    *val;
+  batch_read_at(b, id, &op, &key, &len, &val);
+
+  node *curr = lc->curr;
+  if (op == Write) {
+    val_t *ptr = worker_insert_leaf(w, lc, cp, key, len, val);
+    if (ptr) { // key already exists, update the value and return the previous one
+      batch_set_result_at(b, id, Updated, (const void *)*ptr);
+      *ptr = *(val_t *)val;
+    } else {
+      batch_set_result_at(b, id, Inserted, 0);
+    }
+  } else if (op == Add) {
+    val_t *ptr = worker_insert_leaf(w, lc, cp, key, len, val);
+    if (ptr) { // add delta to the value and return the previous one
+      batch_set_result_at(b, id, Updated, (const void *)*ptr);
+      *ptr += *(val_t *)val;
+    } else {
+      batch_set_result_at(b, id, Inserted, 0);
+    }
+  } else if (op == GetOrInsert) {
+    val_t *ptr = worker_insert_leaf(w, lc, cp, key, len, val);
+    if (ptr)
+      batch_set_result_at(b, id, Found, (const void *)*ptr);
+    else
+      batch_set_result_at(b, id, Inserted, 0);
+  } else if (op == Cas) {
+    // expected value is kept in the result of this kv until now
+    val_t expect = (val_t)batch_get_result_at(b, id);
+    val_t *ptr = node_search_value_ptr(curr, key, len);
+    if (ptr == 0) {
+      batch_set_result_at(b, id, NotFound, 0);
+    } else if (*ptr == expect) {
+      batch_set_result_at(b, id, Updated, (const void *)*ptr);
+      *ptr = *(val_t *)val;
+    } else {
+      batch_set_result_at(b, id, Mismatch, (const void *)*ptr);
+    }
+  } else if (op == Read) {
+    worker_read_leaf(b, id, curr, key, len, val);
+  } else if (op == Delete) {
+    void *old;
+    if (node_delete(curr, key, len, &old))
+      batch_set_result_at(b, id, Deleted, old);
+    else
+      batch_set_result_at(b, id, NotFound, 0);
+  } else { // Scan, execute it after all the leaf modifications are done
+    worker_add_scan(w, id, curr);
+  }
+}
+
+// write or read the keys of path `cp` in leaf node `cn`
+static void worker_execute_on_leaf_path(worker *w, batch *b, leaf_cursor *lc, path *cp, node *cn)
+{
+  fence *fnc = &lc->fnc;
+  node *pn = lc->pn;
+
+  uint32_t  op;
+  void    *key;
+  uint32_t len;
+  void    *val;
+  batch_read_at(b, path_get_kv_id(cp), &op, &key, &len, &val);
+
+  // get the actual leaf node to insert
+#ifdef BStar // B* node
+  // keys of previous path may have moved into `cn`, which may have been split since then,
+  // then current node and fence go on as if this is still the previous path
+  if (cn != pn && !(pn && worker_find_fence(w, 0, cn) && worker_cursor_in_node(w, lc->curr, cn))) {
+    // keys of `cn` may be moved to a new node only if `cn` has been adjusted
+    if (pn && worker_find_fence(w, 0, cn) && node_is_after_key(cn, key, len)) {
+      lc->curr = worker_get_last_insert_fence(w)->ptr;
+      lc->move_left = 1;
+    } else {
+      lc->curr = cn;
+      lc->move_left = 0;
+      fnc->ptr = 0;
+    }
+  } else {
+    if (lc->move_left) {
+      if (node_is_after_key(cn, key, len) == 0) {
+        lc->curr = cn;
+        lc->move_left = 0;
+        fnc->ptr = 0;
+      }
+    } else {
+      if (fnc->ptr && compare_key(key, len, fnc->key, fnc->len) >= 0) {
+        lc->curr = fnc->ptr;
+        fnc->ptr = 0;
+      }
+    }
+  }
+#else
+  if (cn != pn) {
+    lc->curr = cn;
+    fnc->ptr = 0;
+  } else if (fnc->ptr && compare_key(key, len, fnc->key, fnc->len) >= 0) {
+    lc->curr = fnc->ptr;
+    fnc->ptr = 0;
+  }
+#endif // B* node
+
+  // kvs with the same key share this path, execute them in the order they are added
+  for (uint32_t i = 0, id = path_get_kv_id(cp); i < path_get_kv_run(cp); ++i, ++id)
+    worker_execute_on_leaf_kv(w, b, lc, cp, id);
+
+  lc->pn = cn; // record previous node
+  lc->pp = cp;
 }
 
 // process keys assigned to this worker in leaf nodes, worker has already obtained the path information
 void worker_execute_on_leaf_nodes(worker *w, batch *b)
 {
-  fence fnc; fnc.ptr = 0;
-  node *pn   = 0; // previous path node
-  node *curr = 0; // node actually to process the key
+  leaf_cursor lc;
+  leaf_cursor_init(&lc, 0 /* stolen */);
+
+  worker_open_leaf_groups(w);
 
-  int move_left = 0;
   path_iter iter;
   path *cp;
   init_path_iter(&iter, w);
@@ -552,77 +1136,62 @@ void worker_execute_on_leaf_nodes(worker *w, batch *b)
     // TODO: remove this
     assert(cn);
 
-    uint32_t  op;
-    void    *key;
-    uint32_t len;
-    void    *val;
-    batch_read_at(b, path_get_kv_id(cp), &op, &key, &len, &val);
+    // we are done with previous leaf node, deal with underflow caused by deletion
+    if (lc.pn && cn != lc.pn)
+      worker_try_merge_node(w, w, 0, lc.pp, &lc.ln, lc.pn, cn);
 
-    // get the actual leaf node to insert
-  #ifdef BStar // B* node
-    if (cn != pn) {
-      if (pn && node_is_after_key(cn, key, len)) {
-        curr = worker_get_last_insert_fence(w)->ptr;
-        move_left = 1;
-      } else {
-        curr = cn;
-        move_left = 0;
-        fnc.ptr = 0;
-      }
-    } else {
-      if (move_left) {
-        if (node_is_after_key(cn, key, len) == 0) {
-          curr = cn;
-          move_left = 0;
-          fnc.ptr = 0;
-        }
-      } else {
-        if (fnc.ptr && compare_key(key, len, fnc.key, fnc.len) >= 0) {
-          curr = fnc.ptr;
-          fnc.ptr = 0;
-        }
-      }
-    }
-  #else
-    (void)move_left;
-    if (cn != pn) {
-      curr = cn;
-      fnc.ptr = 0;
-    } else if (fnc.ptr && compare_key(key, len, fnc.key, fnc.len) >= 0) {
-      curr = fnc.ptr;
-      fnc.ptr = 0;
+#ifdef Test
+    if (cn != lc.pn && iter.owner == w && w->delay)
+      usleep(w->delay);
+#endif
+    // rest of the leaves are stolen by next worker
+    if (cn != lc.pn && iter.owner == w && !worker_claim_leaf_group(w, iter.offset - 1)) {
+      lc.pn = 0;
+      break;
     }
-  #endif // B* node
 
-    if (op == Write) {
-      switch (node_insert(curr, key, len, (const void *)*(val_t *)val)) {
-      case 1:  // key insert succeed, we set value to 1
-        // set_val(val, 1);
-        break;
-      case 0:  // key already exists, we set value to 0
-        // set_val(val, 0);
-        break;
-      case -1: { // node does not have enough space
-        #ifdef BStar // B* node
-        if (worker_handle_full_leaf_node(w, &curr, cp, &fnc, key, len, val)) {
-          // key insert succeed
-          break;
-        }
-        #endif // BStar
-      }
-      // intentionally fall through
-      case -2: {
-        worker_handle_leaf_node_split(w, &curr, cp, &fnc, key, len, val);
-        break;
-      }
-      default:
-        assert(0);
-      }
-    } else { // Read
-      set_val(val, (val_t)node_search(curr, key, len));
-    }
+    worker_execute_on_leaf_path(w, b, &lc, cp, cn);
+  }
 
-    pn = cn; // record previous node
+  if (lc.pn)
+    worker_try_merge_node(w, w, 0, lc.pp, &lc.ln, lc.pn, 0);
+}
+
+// steal leaf groups from the tail of previous worker one by one until there is none left
+void worker_steal_leaf_nodes(worker *w, batch *b)
+{
+  worker *v = w->prev;
+  if (v == 0) return ;
+
+  // previous worker may not have published its leaf groups of this batch yet
+  uint32_t spin = __atomic_load_n(&w->spin, __ATOMIC_RELAXED), spun = 0;
+  while (__atomic_load_n(&v->claim_epoch, __ATOMIC_ACQUIRE) != w->epoch) {
+    if (spun++ == spin) return ;
+    cpu_relax();
+  }
+
+  uint64_t c = __atomic_load_n(&v->claim, __ATOMIC_ACQUIRE);
+  while (claim_head(c) < claim_tail(c)) {
+    uint32_t tail = claim_tail(c), beg = tail - 1;
+    node *n = path_get_node_at_level(&v->paths[beg], 0);
+    while (beg > claim_head(c) && path_get_node_at_level(&v->paths[beg - 1], 0) == n)
+      --beg;
+    if (!__atomic_compare_exchange_n(&v->claim, &c, claim_make(claim_head(c), beg), 0,
+        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+      continue;
+#ifdef Test
+    ++w->stolen;
+#endif
+
+    // stop right before the group we stole last time, or where `v` would stop
+    node *upcoming = tail < v->leaf_end ? path_get_node_at_level(&v->paths[tail], 0) : 0;
+    leaf_cursor lc;
+    leaf_cursor_init(&lc, 1 /* stolen */);
+    for (uint32_t i = beg; i < tail; ++i)
+      worker_execute_on_leaf_path(w, b, &lc, &v->paths[i], n);
+    worker_try_merge_node(w, v, 0, lc.pp, &lc.ln, n, upcoming);
+
+    c = __atomic_load_n(&v->claim, __ATOMIC_ACQUIRE);
   }
 }
 
@@ -630,15 +1199,40 @@ void worker_execute_on_leaf_nodes(worker *w, batch *b)
 // but with some critical difference
 void worker_execute_on_branch_nodes(worker *w, uint32_t level)
 {
+  char fkey[max_key_size], fokey[max_key_size];
   fence fnc;
+  fnc.ptr  = 0;
+  fnc.key  = fkey;
+  fnc.okey = fokey;
+  fnc.olen = 0;
   node *pn   = 0; // previous path node
   node *curr = 0; // node actually to process the key
 
   fence_iter iter;
   fence *cf;
+
+  // remove fence keys of merged nodes and replace fence keys of adjusted nodes first, so that none of
+  // them will be promoted by a split, and a new node never meets the old fence key of its neighbour,
+  // which may be equal to or bigger than the new node's fence key
   init_fence_iter(&iter, w, level);
-  // iterate all the fence and insert or replace key in the branch node
   while ((cf = next_fence(&iter))) {
+    node *cn = path_get_node_at_level(cf->pth, level);
+    if (cf->type == fence_delete) {
+      assert(node_delete(cn, cf->key, cf->len, 0) == 1);
+    } else if (cf->type == fence_replace) {
+      int r = node_replace_key(cn, cf->okey, cf->olen, cf->ptr, cf->key, cf->len);
+      if (unlikely(r == -1)) // the key to replace can't fit in, not enough space
+        cf->type = fence_insert; // key is already deleted, so we can treat it as insert now
+      else
+        assert(r == 1);
+    }
+  }
+
+  init_fence_iter(&iter, w, level);
+  // iterate all the fence and insert key in the branch node
+  while ((cf = next_fence(&iter))) {
+    if (cf->type != fence_insert) continue; // already done
+
     path *cp = cf->pth;
     node *cn = path_get_node_at_level(cp, level);
     assert(cn);
@@ -655,55 +1249,120 @@ void worker_execute_on_branch_nodes(worker *w, uint32_t level)
       fnc.ptr = 0;
     }
 
-    if (cf->type == fence_replace) {
-      int r = node_replace_key(curr, cf->okey, cf->olen, val, key, len);
-      if (unlikely(r == -1)) { // the key to replace can't fit in, not enough space
-        // key is already deleted, so we can treat it as insert now
-        cf->type = fence_insert;
-      } else if (unlikely(r == 2)) {
-        // the key we are going to replace is about to be promoted to upper level due to a split
-        fence f;
-        memcpy(&f, cf, sizeof(fence));
-        f.ptr = curr;
-        uint32_t before = worker_get_fence_number(w, level);
-        worker_insert_fence(w, level, &f);
-        uint32_t after = worker_get_fence_number(w, level);
-        // make sure this fence key is replaced in fence info
-        assert(before == after);
-      } else {
-        assert(r == 1);
-      }
-    }
-
-    if (cf->type == fence_insert) {
-      switch (node_insert(curr, key, len, val)) {
-      case 1:  // key insert succeed
-        break;
-      case -1: { // node does not have enough space, needs to split
-        node *nn = new_node(Branch, curr->level);
-        node_split(curr, nn, fnc.key, &fnc.len);
-        fnc.pth = cp;
-        fnc.ptr = nn;
-        fnc.type = fence_insert;
-        uint32_t idx = worker_insert_fence(w, level, &fnc);
-        // compare current key with fence key to determine which node to insert
-        if (compare_key(key, len, fnc.key, fnc.len) > 0) { // equal is not possible
-          curr = nn;
-          // advance fence because next key may fall into the next split node
-          worker_advance_fence(w, level, &fnc, idx);
-        }
-        assert(node_insert(curr, key, len, val) == 1);
+    switch (node_insert(curr, key, len, val)) {
+    case 1:  // key insert succeed
+      break;
+    case -1: { // node does not have enough space, needs to split
+#ifdef Prefix
+      // unless prefix compression makes some room, prefix is bounded by the fence keys of
+      // `cn` in parent, which also bound the split node of `cn`
+      if (path_get_level(cp) > level + 1 &&
+          node_compress_branch(curr, node_child_prefix(path_get_node_at_level(cp, level + 1), cn)) &&
+          node_insert(curr, key, len, val) == 1)
         break;
+#endif
+      node *nn = new_node_with_size(Branch, curr->level, node_get_size(curr));
+      node_split(curr, nn, fnc.key, &fnc.len);
+      fnc.pth = cp;
+      fnc.ptr = nn;
+      fnc.type = fence_insert;
+      uint32_t idx = worker_insert_fence(w, level, &fnc);
+      // compare current key with fence key to determine which node to insert
+      if (compare_key(key, len, fnc.key, fnc.len) > 0) { // equal is not possible
+        curr = nn;
+        // advance fence because next key may fall into the next split node
+        worker_advance_fence(w, level, &fnc, idx);
       }
-      case 0:  // key already exists, it's not possible
-        assert(0);
-      default:
-        assert(0);
-      }
+      assert(node_insert(curr, key, len, val) == 1);
+      break;
+    }
+    case 0:  // key already exists, it's not possible
+      assert(0);
+    default:
+      assert(0);
     }
 
     pn = cn; // record previous node
   }
+
+  // now deal with underflow caused by merge in lower level
+  node *ln = 0; // last branch node we finished
+  path *pp = 0; // previous path
+  pn = 0;
+  init_fence_iter(&iter, w, level);
+  while ((cf = next_fence(&iter))) {
+    node *cn = path_get_node_at_level(cf->pth, level);
+    if (cn != pn) {
+      if (pn)
+        worker_try_merge_node(w, w, level, pp, &ln, pn, cn);
+      pn = cn;
+      pp = cf->pth;
+    }
+  }
+
+  if (pn)
+    worker_try_merge_node(w, w, level, pp, &ln, pn, 0);
+}
+
+// read only batch does not modify any node, so there is no conflict between workers,
+// each worker processes every path it descends, shared leaf nodes are not a problem
+void worker_execute_reads(worker *w, batch *b)
+{
+  for (uint32_t i = 0; i < w->cur_path; ++i) {
+    path *cp = &w->paths[i];
+    node *cn = path_get_node_at_level(cp, 0);
+    for (uint32_t j = 0, id = path_get_kv_id(cp); j < path_get_kv_run(cp); ++j, ++id) {
+      uint32_t  op;
+      void    *key;
+      uint32_t len;
+      void    *val;
+      batch_read_at(b, id, &op, &key, &len, &val);
+
+      if (op == Read)
+        worker_read_leaf(b, id, cn, key, len, val);
+      else
+        worker_add_scan(w, id, cn);
+    }
+  }
+
+  worker_execute_scans(w, b, 0 /* root */);
+}
+
+// leaf nodes can be split, merged or adjusted after a scan recorded its leaf, so the start key
+// may have moved to a node on the left, find the leaf from `root` again
+static node* worker_locate_leaf(node *root, const void *key, uint32_t len)
+{
+  node *n = root;
+  while (n->level)
+    n = node_descend(n, key, len);
+  return n;
+}
+
+// execute all the scans recorded in leaf stage, every scan starts at its recorded leaf node and
+// streams along the leaf chain, this function should only be called when leaf nodes are stable,
+// if `root` is not 0, leaf nodes may have been restructured in this batch, and every scan
+// starts at the leaf found from `root` instead of its recorded leaf
+void worker_execute_scans(worker *w, batch *b, node *root)
+{
+  for (uint32_t i = 0; i < w->cur_scan; ++i) {
+    uint32_t  op;
+    void    *key;
+    uint32_t len;
+    void    *val;
+    batch_read_at(b, w->scans[i].id, &op, &key, &len, &val);
+    assert(op == Scan);
+    scan *s = (scan *)(*(val_t *)val);
+
+    node *n = root ? worker_locate_leaf(root, key, len) : w->scans[i].leaf;
+    if (n->next) node_prefetch(n->next);
+    int more = node_scan(n, key, len, s);
+    while (more && (n = n->next)) {
+      if (n->next) node_prefetch(n->next);
+      more = node_scan(n, 0, 0, s);
+    }
+
+    batch_set_result_at(b, w->scans[i].id, s->keys ? Found : NotFound, (const void *)(uint64_t)s->keys);
+  }
 }
 
 void init_path_iter(path_iter *iter, worker *w)
@@ -757,6 +1416,11 @@ fence* next_fence(fence_iter *iter)
 
 #ifdef Test
 
+void worker_set_delay(worker *w, uint32_t delay)
+{
+  w->delay = delay;
+}
+
 void worker_print_path_info(worker *w)
 {
   printf("worker %u path info\n", w->id);
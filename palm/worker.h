@@ -11,6 +11,44 @@
 
 #define channel_size max_descend_depth + 1 // +2 is better but we want `channel_size` to be 8
 
+// how many times a worker checks the condition with `cpu_relax` before it parks in the kernel
+// when waiting for other workers, it can be changed at runtime, see `palm_tree_set_spin`
+#define default_spin_times 4096
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define cpu_relax() __asm__ __volatile__("yield" ::: "memory")
+#else
+#define cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
+
+// a scan can only be executed when all the leaf modifications in this batch are done,
+// so we record the leaf node where its start key lands in for later execution
+typedef struct pending_scan
+{
+  uint32_t  id;   // id of the scan in the batch
+  node     *leaf; // leaf node to start the scan
+}pending_scan;
+
+// fence keys are copied to fence arena when fences are recorded, arena is a list of chunks
+// which are reused after the fences are switched, so there is no allocation once it's warmed up,
+// and keys never move so that other workers can read them through the fences
+#define fence_chunk_size 16384
+
+typedef struct fence_chunk
+{
+  struct fence_chunk *next;
+  uint32_t            used; // bytes used in `data`
+  char                data[0];
+}fence_chunk;
+
+typedef struct fence_arena
+{
+  fence_chunk *head; // first chunk
+  fence_chunk *curr; // chunk in use
+}fence_arena;
+
 /**
  *   every thread has a worker, worker does write/read operations to b+ tree,
  *   worker is chained together to form a double-linked list,
@@ -46,6 +84,31 @@ typedef struct worker
   fence    *fences[2];    // to place the fence key info, there are 2 groups for switch
                           // each of them are sorted according to the key
                           // this is a very cool optimization
+  fence_arena arenas[2];  // to place the fence keys of each group
+
+  uint32_t      max_scan;  // maximum scan number
+  uint32_t      cur_scan;  // current scan number
+  pending_scan *scans;     // scans waiting for all the leaf modifications are done
+
+  uint32_t  radix[radix_buckets]; // bucket count of the part of unsorted batch this worker sorts
+
+  uint32_t  spin;   // spin times before parking
+  uint32_t  wake;   // futex word, bumped every time a neighbour writes `last` or `first`
+  uint32_t  parked; // whether this worker is (going to be) sleeping on `wake`
+  uint32_t  epoch;   // number of tree barriers this worker has entered
+  uint32_t  arrived; // last tree barrier this worker and its children have arrived at
+
+  uint64_t  claim;       // [head, tail) of the leaf groups not taken yet, see `worker_execute_on_leaf_nodes`
+  uint32_t  claim_epoch; // `epoch` when `claim` is published
+  uint32_t  leaf_end;    // end of the paths this worker modifies in leaf level
+
+  uint64_t  ahead_nth;   // queue position (plus 1) of the batch `paths` are descended ahead for, 0 if none
+  uint32_t  ahead_epoch; // root epoch that descent starts from
+
+#ifdef Test
+  uint32_t  delay;  // microseconds to sleep before claiming each leaf group, to get leaves stolen
+  uint32_t  stolen; // leaf groups stolen from previous worker in total
+#endif
 
   struct worker *prev; // previous worker with smaller id
   struct worker *next; // next worker with bigger id
@@ -66,15 +129,26 @@ path* worker_get_new_path(worker *w);
 path* worker_get_path_at(worker *w, uint32_t idx);
 void worker_update_fence(worker *w, uint32_t level, fence *f, uint32_t i);
 void worker_switch_fence(worker *w, uint32_t level);
+void worker_merge_fences(worker *w, worker *child, uint32_t level);
 void worker_get_fences(worker *w, uint32_t level, fence **fences, uint32_t *number);
 void worker_redistribute_work(worker *w, uint32_t level);
+void worker_reset_paths(worker *w);
 void worker_reset(worker *w);
+void worker_set_spin(worker *w, uint32_t spin);
+void worker_park(uint32_t *word, uint32_t val);
+void worker_unpark(uint32_t *word, int all);
+void worker_arrive(worker *w, worker *parent, uint32_t epoch);
+void worker_wait_arrival(worker *w, worker *child, uint32_t epoch);
 void worker_sync(worker *w, uint32_t level, uint32_t root_level);
 void worker_execute_on_leaf_nodes(worker *w, batch *b);
+void worker_steal_leaf_nodes(worker *w, batch *b);
 void worker_execute_on_branch_nodes(worker *w, uint32_t level);
+void worker_execute_scans(worker *w, batch *b, node *root);
+void worker_execute_reads(worker *w, batch *b);
 
 #ifdef Test
 
+void worker_set_delay(worker *w, uint32_t delay);
 void worker_print_path_info(worker *w);
 void worker_print_fence_info(worker *w, uint32_t level);
 
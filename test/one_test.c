@@ -78,16 +78,20 @@ static void* run(void *arg)
     switch (ta->tp) {
     case PALM: {
       batch *batches[8 /* queue_size */ + 1];
-      for (int i = 0; i < 9; ++i)
+      uint64_t tickets[9];
+      for (int i = 0; i < 9; ++i) {
         batches[i] = new_batch();
+        tickets[i] = 0;
+      }
       int idx = 0;
       batch *cb = batches[idx];
       for (int i = 0; i < keys; ++i) {
         uint64_t key = rng_next(&r);
         if (batch_add_write(cb, &key, 8, (void *)3190) == -1) {
-          palm_tree_execute(ta->tree.pt, cb);
+          tickets[idx] = palm_tree_execute(ta->tree.pt, cb);
           idx = idx == 8 ? 0 : idx + 1;
           cb = batches[idx];
+          palm_tree_wait(ta->tree.pt, tickets[idx]);
           batch_clear(cb);
           assert(batch_add_write(cb, &key, 8, (void *)3190) == 1);
         }
@@ -135,16 +139,20 @@ static void* run(void *arg)
     switch (ta->tp) {
     case PALM: {
       batch *batches[8 /* queue_size */ + 1];
-      for (int i = 0; i < 9; ++i)
+      uint64_t tickets[9];
+      for (int i = 0; i < 9; ++i) {
         batches[i] = new_batch();
+        tickets[i] = 0;
+      }
       int idx = 0;
       batch *cb = batches[idx];
       for (int i = 0; i < keys; ++i) {
         uint64_t key = rng_next(&r);
         if (batch_add_read(cb, &key, 8) == -1) {
-          palm_tree_execute(ta->tree.pt, cb);
+          tickets[idx] = palm_tree_execute(ta->tree.pt, cb);
           idx = idx == 8 ? 0 : idx + 1;
           cb = batches[idx];
+          palm_tree_wait(ta->tree.pt, tickets[idx]);
           for (uint32_t j = 0; j < cb->keys; ++j)
             assert((uint64_t)batch_get_value_at(cb, j) == 3190);
           batch_clear(cb);
@@ -48,11 +48,16 @@ void test_batch_clear()
   batch *b = new_batch();
 
   assert(batch_add_write(b, key, len, (void *)0) == 1);
+  assert(!batch_is_read_only(b));
 
   batch_clear(b);
 
   assert(b->keys == 0);
   assert(b->off == 0);
+  assert(batch_is_read_only(b));
+
+  assert(batch_add_read(b, key, len) == 1);
+  assert(batch_is_read_only(b));
 
   free_batch(b);
 }
@@ -163,6 +168,192 @@ void test_print_batch()
   free_batch(b);
 }
 
+void test_batch_result()
+{
+  printf("test batch result\n");
+
+  key_buf(key, 10);
+
+  batch *b = new_batch();
+
+  // add keys in descending order, so that the order in batch is the reverse of submission order
+  for (uint32_t i = 0; i < 10; ++i) {
+    key[i] = '1';
+    assert(batch_add_write(b, key, len, (void *)(uint64_t)i) == 1);
+    key[i] = '0';
+  }
+
+  for (uint32_t i = 0; i < 10; ++i)
+    batch_set_result_at(b, i, i % 2 ? Inserted : Updated, (void *)(uint64_t)i);
+
+  void *val;
+  for (uint32_t i = 0; i < 10; ++i) {
+    uint32_t idx = 10 - i - 1;
+    assert(batch_get_result(b, i, &val) == (idx % 2 ? Inserted : Updated));
+    assert((uint64_t)val == idx);
+  }
+
+  free_batch(b);
+}
+
+void test_batch_read_modify_write()
+{
+  printf("test batch read modify write\n");
+
+  key_buf(key, 10);
+
+  batch *b = new_batch();
+
+  assert(batch_add_get_or_insert(b, key, len, (void *)1) == 1);
+  assert(!batch_is_read_only(b));
+  key[0] = '1';
+  assert(batch_add_cas(b, key, len, (void *)2, (void *)3) == 1);
+  key[1] = '1';
+  assert(batch_add_add(b, key, len, (void *)4) == 1);
+
+  uint32_t op;
+  char *key2;
+  uint32_t len2;
+  void *val;
+  batch_read_at(b, 0, &op, (void **)&key2, &len2, &val);
+  assert(op == GetOrInsert && *(val_t *)val == 1);
+  batch_read_at(b, 1, &op, (void **)&key2, &len2, &val);
+  assert(op == Cas && *(val_t *)val == 3);
+  batch_read_at(b, 2, &op, (void **)&key2, &len2, &val);
+  assert(op == Add && *(val_t *)val == 4);
+  // expected value of cas is kept in its result
+  assert((uint64_t)batch_get_result_at(b, 1) == 2);
+
+  free_batch(b);
+}
+
+void test_batch_prefix()
+{
+  printf("test batch prefix\n");
+
+  batch *b = new_batch();
+  batch_set_unsorted(b, 1);
+  uint32_t *tmp = (uint32_t *)malloc(get_batch_size());
+
+  uint32_t len;
+  assert(batch_add_write(b, "tenant-1/user/42", 16, 0) == 1);
+  batch_get_prefix(b, &len);
+  assert(len == 16);
+  assert(batch_add_write(b, "tenant-1/user/7", 15, 0) == 1);
+  assert(batch_add_read(b, "tenant-1/order/3", 16) == 1);
+  const char *pre = batch_get_prefix(b, &len);
+  assert(len == 9 && !memcmp(pre, "tenant-1/", len));
+
+  // sort starts after the common prefix
+  batch_sort(b, tmp);
+  batch_validate(b);
+
+  batch_clear(b);
+  batch_get_prefix(b, &len);
+  assert(len == 0);
+
+  free(tmp);
+  free_batch(b);
+}
+
+void test_batch_sort()
+{
+  printf("test batch sort\n");
+
+  batch *sorted = new_batch();
+  batch *unsorted = new_batch();
+  batch_set_unsorted(unsorted, 1);
+  uint32_t *tmp = (uint32_t *)malloc(get_batch_size());
+
+  // random keys with different length and lots of duplicates
+  srand(time(NULL));
+  char key[64];
+  for (uint32_t i = 0; ; ++i) {
+    uint32_t len = rand() % 40;
+    for (uint32_t j = 0; j < len; ++j)
+      key[j] = 'a' + rand() % 3;
+    if (batch_add_write(sorted, key, len, (void *)(uint64_t)i) == -1)
+      break;
+    assert(batch_add_write(unsorted, key, len, (void *)(uint64_t)i) == 1);
+  }
+
+  assert(batch_is_unsorted(unsorted));
+  batch_sort(unsorted, tmp);
+  batch_validate(unsorted);
+
+  // duplicate keys must be in the same order as they are added
+  assert(sorted->keys == unsorted->keys);
+  for (uint32_t i = 0; i < sorted->keys; ++i) {
+    uint32_t op1, op2, len1, len2;
+    void *key1, *key2, *val1, *val2;
+    batch_read_at(sorted, i, &op1, &key1, &len1, &val1);
+    batch_read_at(unsorted, i, &op2, &key2, &len2, &val2);
+    assert(compare_key(key1, len1, key2, len2) == 0);
+    assert(*(val_t *)val1 == *(val_t *)val2);
+  }
+
+  free(tmp);
+  free_batch(sorted);
+  free_batch(unsorted);
+}
+
+void test_batch_segments()
+{
+  printf("test batch segments\n");
+
+  batch *single = new_batch();
+  batch *chain = new_batch();
+  batch_set_segments(chain, 4);
+  assert(batch_is_unsorted(chain));
+
+  // random keys with lots of duplicates, value is the order they are added
+  srand(time(NULL));
+  char key[64];
+  uint32_t i = 0;
+  for (; ; ++i) {
+    uint32_t len = rand() % 40;
+    for (uint32_t j = 0; j < len; ++j)
+      key[j] = 'a' + rand() % 3;
+    if (batch_add_write(chain, key, len, (void *)(uint64_t)i) == -1)
+      break;
+    batch_add_write(single, key, len, 0);
+  }
+  uint32_t keys = batch_get_keys(chain);
+  assert(keys == i && keys > single->keys * 3);
+
+  uint32_t *tmp = (uint32_t *)malloc(sizeof(uint32_t) * batch_sort_buffer(keys));
+  batch_sort(chain, tmp);
+  batch_validate(chain);
+
+  // duplicate keys are in the order they are added, results go back to where kvs are added
+  uint32_t op, plen = 0;
+  void *pkey = 0, *pval = 0;
+  for (i = 0; i < keys; ++i) {
+    uint32_t len;
+    void *key, *val;
+    batch_read_at(chain, i, &op, &key, &len, &val);
+    if (i && compare_key(pkey, plen, key, len) == 0)
+      assert(*(val_t *)pval < *(val_t *)val);
+    pkey = key, plen = len, pval = val;
+    batch_set_result_at(chain, i, Inserted, (void *)(uint64_t)i);
+  }
+  for (i = 0; i < keys; ++i) {
+    void *idx;
+    assert(batch_get_result(chain, i, &idx) == Inserted);
+    uint32_t len;
+    void *key, *val;
+    batch_read_at(chain, (uint32_t)(uint64_t)idx, &op, &key, &len, &val);
+    assert(*(val_t *)val == i);
+  }
+
+  batch_clear(chain);
+  assert(batch_get_keys(chain) == 0);
+
+  free(tmp);
+  free_batch(single);
+  free_batch(chain);
+}
+
 int main()
 {
   test_set_batch_size();
@@ -170,6 +361,11 @@ int main()
   test_batch_clear();
   test_batch_write();
   test_batch_read();
+  test_batch_result();
+  test_batch_read_modify_write();
+  test_batch_sort();
+  test_batch_prefix();
+  test_batch_segments();
   test_print_batch();
 
   return 0;
@@ -29,7 +29,18 @@ void test_set_node_size()
   set_node_size(10000);
   assert(get_node_size() == 8192);
 
+  // branch node can be smaller than leaf and is sized in kb
+  assert(get_level_node_size(0, 1500) == node_min_size);
+  assert(get_level_node_size(1, 100) == branch_min_size);
+  assert(get_level_node_size(2, 3000) == 2048);
+  node *n = new_node_with_size(Branch, 1, get_level_node_size(1, 3000));
+  assert(node_get_size(n) == 2048);
+  free_node(n);
+
   set_node_size(node_min_size);
+  n = new_node(Leaf, 0);
+  assert(node_get_size(n) == node_min_size);
+  free_node(n);
 }
 
 void test_new_node()
@@ -396,10 +407,382 @@ void test_node_replace_key()
   free_node(n);
 }
 
+void test_node_scan()
+{
+  printf("test node scan\n");
+
+  key_buf(key, 10);
+
+  node *n = new_node(Leaf, 0);
+
+  for (uint32_t i = 0; i < len; ++i) {
+    key[len - i - 1] = '1';
+    assert(node_insert(n, key, len, (void *)(uint64_t)i) == 1);
+    key[len - i - 1] = '0';
+  }
+
+  char buf[4096];
+  scan s;
+
+  // scan the whole node
+  scan_init(&s, 0, 0, 0, buf, sizeof(buf));
+  assert(node_scan(n, 0, 0, &s) == 1);
+  assert(s.keys == len);
+
+  // scan [key with value 2, key with value 5)
+  char end[len];
+  memcpy(end, key, len);
+  end[4] = '1';
+  scan_init(&s, end, len, 0, buf, sizeof(buf));
+  key[7] = '1';
+  assert(node_scan(n, key, len, &s) == 0);
+  assert(s.keys == 3);
+
+  uint32_t off = 0, klen, count = 0;
+  void *k, *v;
+  while (scan_next(&s, &off, &k, &klen, &v)) {
+    assert(klen == len);
+    assert((uint64_t)v == 2 + count);
+    ++count;
+  }
+  assert(count == 3);
+
+  // scan with limit
+  scan_init(&s, 0, 0, 4, buf, sizeof(buf));
+  assert(node_scan(n, 0, 0, &s) == 0);
+  assert(s.keys == 4);
+
+  free_node(n);
+}
+
+void test_node_delete()
+{
+  printf("test node delete\n");
+
+  key_buf(key, 10);
+
+  node *n = new_node(Leaf, 0);
+
+  for (uint32_t i = 0; i < len; ++i) {
+    key[len - i - 1] = '1';
+    assert(node_insert(n, key, len, (void *)(uint64_t)i) == 1);
+    key[len - i - 1] = '0';
+  }
+
+  // key does not exist
+  assert(node_delete(n, key, len, 0) == 0);
+
+  void *val;
+  for (uint32_t i = 0; i < len; i += 2) {
+    key[len - i - 1] = '1';
+    assert(node_delete(n, key, len, &val) == 1);
+    assert((val_t)val == i);
+    assert(node_search(n, key, len) == 0);
+    key[len - i - 1] = '0';
+  }
+  assert(n->keys == len / 2);
+  node_validate(n);
+
+  for (uint32_t i = 1; i < len; i += 2) {
+    key[len - i - 1] = '1';
+    assert(*node_search_value_ptr(n, key, len) == i);
+    assert(node_delete(n, key, len, 0) == 1);
+    key[len - i - 1] = '0';
+  }
+  assert(n->keys == 0);
+  assert(n->off == 0);
+
+  free_node(n);
+}
+
+void test_node_merge()
+{
+  printf("test node merge\n");
+
+  key_buf(key, 10);
+
+  node *left = new_node(Leaf, 0);
+  node *right = new_node(Leaf, 0);
+  left->next = right;
+
+  for (uint32_t i = 0; i < len; ++i) {
+    key[len - i - 1] = '1';
+    assert(node_insert(i < len / 2 ? left : right, key, len, (void *)(uint64_t)i) == 1);
+    key[len - i - 1] = '0';
+  }
+
+  assert(node_is_underfull(left) && node_is_underfull(right));
+  assert(node_merge(left, right, 0, 0) == 1);
+  assert(left->keys == len);
+  assert(left->next == 0);
+  node_validate(left);
+
+  for (uint32_t i = 0; i < len; ++i) {
+    key[len - i - 1] = '1';
+    assert((val_t)node_search(left, key, len) == i);
+    key[len - i - 1] = '0';
+  }
+
+  free_node(left);
+  free_node(right);
+
+  // merge branch nodes, fence key of `right` is pulled down
+  left = new_node(Branch, 1);
+  right = new_node(Branch, 1);
+  left->next = right;
+
+  key[2] = '1';
+  assert(node_insert(left, key, len, (void *)(uint64_t)1) == 1);
+  key[2] = '0';
+  key[1] = '1';
+  right->first = (node *)(uint64_t)2;
+  key[0] = '1';
+  assert(node_insert(right, key, len, (void *)(uint64_t)3) == 1);
+  key[0] = '0';
+
+  assert(node_merge(left, right, key, len) == 1);
+  assert(left->keys == 3);
+  assert((val_t)node_descend(left, key, len) == 2);
+  node_validate(left);
+
+  free_node(left);
+  free_node(right);
+}
+
+void test_node_fingerprint()
+{
+  printf("test node fingerprint\n");
+
+  key_buf(key, 16);
+
+  node *n = new_node(Leaf, 0);
+  char keys[512][16];
+  uint32_t total = 0;
+  srand(time(NULL));
+  // fill the node until it's full, fingerprints become invalid when there is no room for them
+  while (total < 512) {
+    for (uint32_t i = 0; i < len; ++i)
+      key[i] = 'a' + (rand() % 26);
+    int r = node_insert(n, key, len, (void *)(uint64_t)(total + 1));
+    if (r == -1) break;
+    if (r == 0) continue;
+    memcpy(keys[total++], key, len);
+    assert((uint64_t)node_search(n, key, len) == total);
+#ifdef Fingerprint
+    if (total == 1) assert(n->sopt == 1);
+#endif
+    node_validate(n);
+  }
+  assert(n->keys == total);
+
+  for (uint32_t i = 0; i < total; ++i) {
+    assert((uint64_t)node_search(n, keys[i], len) == i + 1);
+    assert(*node_search_value_ptr(n, keys[i], len) == i + 1);
+  }
+
+  // deletion keeps fingerprints valid
+  for (uint32_t i = 0; i < total; i += 2) {
+    assert(node_delete(n, keys[i], len, 0) == 1);
+    assert(node_search(n, keys[i], len) == 0);
+  }
+  node_validate(n);
+#ifdef Fingerprint
+  assert(n->sopt == 1);
+#endif
+  for (uint32_t i = 1; i < total; i += 2)
+    assert((uint64_t)node_search(n, keys[i], len) == i + 1);
+
+  free_node(n);
+}
+
+void test_node_heads()
+{
+  printf("test node heads\n");
+
+  key_buf(key, 16);
+
+  node *n = new_node(Branch, 1);
+  n->first = (node *)(uint64_t)1;
+  char keys[96][16];
+  uint32_t total = 0;
+  srand(time(NULL));
+  // separators share a long prefix and only differ in a few bytes
+  memcpy(key, "prefix", 6);
+  // heads take space as well, don't fill the node
+  while (total < 96) {
+    for (uint32_t i = 10; i < len; ++i)
+      key[i] = 'a' + (rand() % 4);
+    int r = node_insert(n, key, len, (void *)(uint64_t)(total + 2));
+    assert(r >= 0);
+    if (r == 0) continue;
+    memcpy(keys[total++], key, len);
+    node_validate(n);
+  }
+#ifdef Heads
+  assert(n->sopt == 10 + 1);
+#endif
+
+  // child of `key` is the one of the greatest separator not greater than `key`
+  for (uint32_t t = 0; t < 4096; ++t) {
+    for (uint32_t i = 6; i < len; ++i)
+      key[i] = rand() % 8 ? 'a' + (rand() % 4) : '0';
+    uint32_t klen = 6 + rand() % (len - 5);
+    uint64_t expect = 1;
+    char *best = 0;
+    for (uint32_t i = 0; i < total; ++i)
+      if (compare_key(keys[i], len, key, klen) <= 0 && (!best || memcmp(keys[i], best, len) > 0)) {
+        best = keys[i];
+        expect = i + 2;
+      }
+    assert((uint64_t)node_descend(n, key, klen) == expect);
+  }
+  for (uint32_t i = 0; i < total; ++i)
+    assert((uint64_t)node_descend(n, keys[i], len) == i + 2);
+
+  free_node(n);
+}
+
+void test_node_branch_prefix()
+{
+  printf("test node branch prefix\n");
+
+  key_buf(key, 16);
+
+  node *n = new_node(Branch, 1);
+  n->first = (node *)(uint64_t)1;
+  char keys[96][16];
+  uint32_t total = 0;
+  srand(time(NULL));
+  memcpy(key, "prefix", 6);
+  while (total < 96) {
+    for (uint32_t i = 10; i < len; ++i)
+      key[i] = 'a' + (rand() % 4);
+    int r = node_insert(n, key, len, (void *)(uint64_t)(total + 2));
+    assert(r >= 0);
+    if (r == 0) continue;
+    memcpy(keys[total++], key, len);
+  }
+
+  // prefix is bounded by what every key in this node has
+  assert(node_compress_branch(n, 8) == 1 && n->pre == 8);
+  assert(node_compress_branch(n, 8) == 0);
+  node_validate(n);
+
+  // keys without the prefix go to the first or the last child
+  for (uint32_t t = 0; t < 4096; ++t) {
+    key[4] = rand() % 4 ? 'i' : 'h' + (rand() % 3);
+    for (uint32_t i = 6; i < 10; ++i)
+      key[i] = rand() % 16 ? '0' : '/' + (rand() % 3);
+    for (uint32_t i = 10; i < len; ++i)
+      key[i] = rand() % 8 ? 'a' + (rand() % 4) : '0';
+    uint32_t klen = 4 + rand() % (len - 3);
+    uint64_t expect = 1;
+    char *best = 0;
+    for (uint32_t i = 0; i < total; ++i)
+      if (compare_key(keys[i], len, key, klen) <= 0 && (!best || memcmp(keys[i], best, len) > 0)) {
+        best = keys[i];
+        expect = i + 2;
+      }
+    assert((uint64_t)node_descend(n, key, klen) == expect);
+  }
+  for (uint32_t i = 0; i < total; ++i)
+    assert((uint64_t)node_descend(n, keys[i], len) == i + 2);
+
+  // separators are still whole keys outside the node
+  char buf[max_key_size];
+  uint32_t buf_len;
+  assert(node_get_child_key(n, (node *)(uint64_t)2, buf, &buf_len) == 1);
+  assert(compare_key(buf, buf_len, keys[0], len) == 0);
+  assert(node_child_prefix(n, (node *)(uint64_t)1) == 8);
+
+  // split keeps the prefix and promotes a whole key
+  node *m = new_node(Branch, 1);
+  node_split(n, m, buf, &buf_len);
+  assert(m->pre == 8 && buf_len == len && memcmp(buf, "prefix", 6) == 0);
+  node_validate(n);
+  node_validate(m);
+  for (uint32_t i = 0; i < total; ++i) {
+    int r = compare_key(keys[i], len, buf, buf_len);
+    if (r) assert((uint64_t)node_descend(r < 0 ? n : m, keys[i], len) == i + 2);
+  }
+
+  free_node(m);
+  free_node(n);
+}
+
+#ifdef FixedKey
+void test_node_fixed_key()
+{
+  printf("test node fixed key\n");
+
+  node *n = new_node(Leaf, 0);
+  uint64_t keys[2048];
+  uint32_t total = 0;
+  srand(time(NULL));
+  while (total < 2048) {
+    uint64_t key = ((uint64_t)rand() << 32) | rand();
+    int r = node_insert(n, &key, 8, (void *)(key + 1));
+    if (r == -1) break;
+    if (r == 0) continue;
+    keys[total++] = key;
+  }
+  assert(n->keys == total);
+  node_validate(n);
+
+  for (uint32_t i = 0; i < total; ++i) {
+    assert((uint64_t)node_search(n, &keys[i], 8) == keys[i] + 1);
+    assert(*node_search_value_ptr(n, &keys[i], 8) == keys[i] + 1);
+  }
+
+  // split keeps the order and the fence key is the whole first key of `new`
+  node *m = new_node(Leaf, 0);
+  char fkey[max_key_size];
+  uint32_t flen;
+  node_split(n, m, fkey, &flen);
+  assert(flen == 8 && n->keys + m->keys == total);
+  node_validate(n);
+  node_validate(m);
+  assert(node_is_after_key(m, fkey, flen) == 0);
+  for (uint32_t i = 0; i < total; ++i) {
+    node *t = compare_key(&keys[i], 8, fkey, flen) < 0 ? n : m;
+    assert((uint64_t)node_search(t, &keys[i], 8) == keys[i] + 1);
+  }
+
+  // branch descends to the child of the greatest separator not greater than the key
+  node *b = new_node(Branch, 1);
+  b->first = n;
+  assert(node_insert(b, fkey, flen, m) == 1);
+  for (uint32_t i = 0; i < total; ++i) {
+    node *t = compare_key(&keys[i], 8, fkey, flen) < 0 ? n : m;
+    assert(node_descend(b, &keys[i], 8) == t);
+  }
+
+  // delete and merge back
+  void *val;
+  for (uint32_t i = 0; i < total; i += 2) {
+    node *t = node_descend(b, &keys[i], 8);
+    assert(node_delete(t, &keys[i], 8, &val) == 1 && (uint64_t)val == keys[i] + 1);
+    assert(node_search(t, &keys[i], 8) == 0);
+  }
+  assert(node_merge(n, m, 0, 0) == 1);
+  node_validate(n);
+  for (uint32_t i = 1; i < total; i += 2)
+    assert((uint64_t)node_search(n, &keys[i], 8) == keys[i] + 1);
+
+  free_node(b);
+  free_node(m);
+  free_node(n);
+}
+#endif // FixedKey
+
 int main()
 {
   test_set_node_size();
   test_new_node();
+#ifdef FixedKey
+  test_node_fixed_key();
+  return 0;
+#endif
   test_node_insert();
   test_node_insert_no_space();
   test_node_search();
@@ -411,6 +794,12 @@ int main()
   test_node_adjust_few();
   test_node_adjust_many();
   test_node_replace_key();
+  test_node_scan();
+  test_node_delete();
+  test_node_merge();
+  test_node_fingerprint();
+  test_node_heads();
+  test_node_branch_prefix();
 
   return 0;
 }
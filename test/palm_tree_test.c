@@ -4,7 +4,7 @@
  *    license:    BSD-3
 **/
 
-#define _XOPEN_SOURCE 500
+#define _XOPEN_SOURCE 600
 
 #include <stdio.h>
 #include <string.h>
@@ -13,8 +13,10 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/time.h>
+#include <pthread.h>
 
 #include "../palm/palm_tree.h"
+#include "../palm/batcher.h"
 #include "../palm/metric.h"
 
 static const uint64_t value = 3190;
@@ -22,6 +24,7 @@ static char *file_str;
 static int queue_size;
 static int thread_number;
 static int total_keys;
+static int branch_size;
 
 static long long mstime()
 {
@@ -37,9 +40,16 @@ static long long mstime()
 void test_palm_tree()
 {
   palm_tree *pt = new_palm_tree(thread_number, queue_size);
+  if (branch_size && palm_tree_set_node_size(pt, get_node_size(), branch_size)) {
+    printf("invalid branch size %d\n", branch_size);
+    exit(1);
+  }
   batch *batches[queue_size + 1];
-  for (int i = 0; i < queue_size + 1; ++i)
+  uint64_t tickets[queue_size + 1];
+  for (int i = 0; i < queue_size + 1; ++i) {
     batches[i] = new_batch();
+    tickets[i] = 0;
+  }
 
   char file_name[32];
   memset(file_name, 0, 32);
@@ -75,9 +85,11 @@ void test_palm_tree()
       }
 
       if (batch_add_write(cb, key, len, (void *)value) == -1) {
-        palm_tree_execute(pt, cb);
+        tickets[idx] = palm_tree_execute(pt, cb);
         idx = idx == queue_size ? 0 : idx + 1;
         cb = batches[idx];
+        // batch can be reused once it's done
+        palm_tree_wait(pt, tickets[idx]);
         batch_clear(cb);
         assert(batch_add_write(cb, key, len, (void *)value) == 1);
       }
@@ -122,9 +134,11 @@ void test_palm_tree()
       }
 
       if (batch_add_read(cb, key, len) == -1) {
-        palm_tree_execute(pt, cb);
+        tickets[idx] = palm_tree_execute(pt, cb);
         idx = idx == queue_size ? 0 : idx + 1;
         cb = batches[idx];
+        // batch can be reused once it's done
+        palm_tree_wait(pt, tickets[idx]);
         for (uint32_t j = 0; j < cb->keys; ++j)
           assert((uint64_t)batch_get_value_at(cb, j) == value);
         batch_clear(cb);
@@ -156,10 +170,974 @@ void test_palm_tree()
   free_palm_tree(pt);
 }
 
+/**
+ *   self-contained tests, they run when no data file is given
+**/
+
+#ifdef FixedKey
+#define key_len fixed_key_size
+#else
+#define key_len 16
+#endif
+
+// keys are in the order of `i`, the bytes after it make prefix compression not that effective
+static void key_of(char *key, uint32_t i)
+{
+#ifdef FixedKey
+  // big endian so that byte order is the same as integer order
+  uint64_t k = ((uint64_t)i << 32) | ((i * 2654435761u) >> 8);
+  for (int j = key_len - 1; j >= 0; --j, k >>= 8)
+    key[j] = (char)(k & 0xff);
+#else
+  char buf[32];
+  snprintf(buf, sizeof(buf), "k%05u%010lu", i, (unsigned long)((i * 2654435761u) % 10000000000ul));
+  memcpy(key, buf, key_len);
+#endif
+}
+
+// execute `b` and wait until it's done
+static void run_batch(palm_tree *pt, batch *b)
+{
+  palm_tree_wait(pt, palm_tree_execute(pt, b));
+}
+
+// write keys in [beg, end) by `step`, value of key `i` is `i + 1`
+static void load_keys(palm_tree *pt, batch *b, uint32_t beg, uint32_t end, uint32_t step)
+{
+  char key[key_len];
+  batch_clear(b);
+  for (uint32_t i = beg; i < end; i += step) {
+    key_of(key, i);
+    if (batch_add_write(b, key, key_len, (void *)(uint64_t)(i + 1)) == -1) {
+      run_batch(pt, b);
+      batch_clear(b);
+      assert(batch_add_write(b, key, key_len, (void *)(uint64_t)(i + 1)) == 1);
+    }
+  }
+  run_batch(pt, b);
+  batch_clear(b);
+}
+
+// add `op` of key `i` to `b`, value of a write is `i + 1`
+static int add_key(batch *b, uint32_t op, uint32_t i)
+{
+  char key[key_len];
+  key_of(key, i);
+  return op == Read   ? batch_add_read(b, key, key_len) :
+         op == Delete ? batch_add_delete(b, key, key_len) :
+                        batch_add_write(b, key, key_len, (void *)(uint64_t)(i + 1));
+}
+
+// result of key `k` in [beg, end) by `step` should be `status`,
+// and its value or previous value should be `k + 1` if there is one
+static void check_results(batch *b, uint32_t beg, uint32_t end, uint32_t step, uint32_t status)
+{
+  for (uint32_t seq = 0, k = beg; k < end; ++seq, k += step) {
+    void *val;
+    assert(batch_get_result(b, seq, &val) == status);
+    if (status == Found || status == Updated || status == Deleted)
+      assert((uint64_t)val == k + 1);
+  }
+}
+
+// add `op` for keys in [beg, end) by `step`, result of key `i` should be `status`
+static void apply_keys(palm_tree *pt, batch *b, uint32_t op, uint32_t beg, uint32_t end, uint32_t step,
+  uint32_t status)
+{
+  for (uint32_t i = beg; i < end; ) {
+    batch_clear(b);
+    uint32_t first = i;
+    for (; i < end && add_key(b, op, i) == 1; i += step) ;
+    run_batch(pt, b);
+    check_results(b, first, i, step, status);
+  }
+  batch_clear(b);
+}
+
+#define pipe_depth 8
+
+// same as `apply_keys` for keys in [beg + r, end) by `step`, r = 0, 1 ... `rounds` - 1,
+// but up to `pipe_depth` batches are in the queue at the same time
+static void pipe_keys(palm_tree *pt, batch **bs, uint32_t op, uint32_t beg, uint32_t end, uint32_t step,
+  uint32_t rounds, uint32_t status)
+{
+  uint64_t ticket[pipe_depth] = {0};
+  uint32_t first[pipe_depth], last[pipe_depth], inflight = 0;
+  for (uint32_t r = 0, i = beg, k = 0; r < rounds || inflight; k = (k + 1) % pipe_depth) {
+    batch *b = bs[k];
+    if (ticket[k]) {
+      palm_tree_wait(pt, ticket[k]);
+      check_results(b, first[k], last[k], step, status);
+      ticket[k] = 0;
+      --inflight;
+    }
+    if (r == rounds) continue;
+    batch_clear(b);
+    first[k] = i;
+    for (; i < end && add_key(b, op, i) == 1; i += step) ;
+    last[k] = i;
+    ticket[k] = palm_tree_execute(pt, b);
+    ++inflight;
+    if (i >= end)
+      i = beg + ++r;
+  }
+}
+
+// what the tree should look like, so that results of any mix of operations can be checked
+typedef struct model
+{
+  uint64_t *vals;         // value of key `i` is `vals[i]`, 0 if it's not in the tree
+  uint32_t  count;        // kvs in the batch
+  uint32_t  status[4096]; // expected result of every kv in the batch
+  uint64_t  prev[4096];   // expected value of every kv in the batch
+}model;
+
+// add `op` of key `i` to `b`
+static int model_add_op(batch *b, uint32_t op, uint32_t i, uint64_t val, uint64_t expect)
+{
+  char key[key_len];
+  key_of(key, i);
+  switch (op) {
+  case Write:       return batch_add_write(b, key, key_len, (void *)val);
+  case Add:         return batch_add_add(b, key, key_len, (void *)val);
+  case GetOrInsert: return batch_add_get_or_insert(b, key, key_len, (void *)val);
+  case Cas:         return batch_add_cas(b, key, key_len, (void *)expect, (void *)val);
+  case Delete:      return batch_add_delete(b, key, key_len);
+  default:          return batch_add_read(b, key, key_len);
+  }
+}
+
+// execute `b` and check every result against `m`
+static void model_run(model *m, palm_tree *pt, batch *b)
+{
+  run_batch(pt, b);
+  for (uint32_t seq = 0; seq < m->count; ++seq) {
+    void *val;
+    assert(batch_get_result(b, seq, &val) == m->status[seq]);
+    assert((uint64_t)val == m->prev[seq]);
+  }
+  batch_clear(b);
+  m->count = 0;
+}
+
+// add `op` of key `i` to `b`, and work out its result from `m` as the tree should,
+// `b` is executed first if it's full
+static void model_add(model *m, palm_tree *pt, batch *b, uint32_t op, uint32_t i, uint64_t val,
+  uint64_t expect)
+{
+  if (m->count == sizeof(m->status) / sizeof(m->status[0]) ||
+      model_add_op(b, op, i, val, expect) == -1) {
+    model_run(m, pt, b);
+    assert(model_add_op(b, op, i, val, expect) == 1);
+  }
+
+  uint64_t *v = &m->vals[i], prev = *v;
+  uint32_t status;
+  switch (op) {
+  case Write:
+    status = prev ? Updated : Inserted;
+    *v = val;
+    break;
+  case Add:
+    status = prev ? Updated : Inserted;
+    *v += val;
+    break;
+  case GetOrInsert:
+    status = prev ? Found : Inserted;
+    if (!prev) *v = val;
+    break;
+  case Cas:
+    status = !prev ? NotFound : prev == expect ? Updated : Mismatch;
+    if (status == Updated) *v = val;
+    break;
+  case Delete:
+    status = prev ? Deleted : NotFound;
+    *v = 0;
+    break;
+  default:
+    status = prev ? Found : NotFound;
+  }
+  m->status[m->count] = status;
+  m->prev[m->count++] = status == Inserted || status == NotFound ? 0 : prev;
+}
+
+// every key in [0, n) is read back with the value in `m`
+static void model_check(model *m, palm_tree *pt, batch *b, uint32_t n)
+{
+  for (uint32_t i = 0; i < n; ++i)
+    model_add(m, pt, b, Read, i, 0, 0);
+  model_run(m, pt, b);
+}
+
+// check that scan `s` collected `count` consecutive keys from key `from`, step by `step`
+static void check_scan(scan *s, uint32_t from, uint32_t step, uint32_t count)
+{
+  assert(s->keys == count);
+  char expect[key_len];
+  uint32_t off = 0, len, i = from, n = 0;
+  void *key, *val;
+  while (scan_next(s, &off, &key, &len, &val)) {
+    key_of(expect, i);
+    assert(len == key_len && memcmp(key, expect, len) == 0 && (uint64_t)val == i + 1);
+    i += step;
+    ++n;
+  }
+  assert(n == count);
+}
+
+// writes in the same batch split the leaf that a scan starts in, the scan still starts at its key
+static void test_scan_after_split(int threads)
+{
+  printf("test scan after split, %d workers\n", threads);
+
+  palm_tree *pt = new_palm_tree(threads, 1);
+  batch *b = new_batch();
+  load_keys(pt, b, 0, 20000, 2);
+
+  char key[key_len], buf[1024];
+  for (uint32_t i = 10001; i < 10200; i += 2) {
+    key_of(key, i);
+    assert(batch_add_write(b, key, key_len, (void *)(uint64_t)(i + 1)) == 1);
+  }
+  scan s;
+  scan_init(&s, 0, 0, 20, buf, sizeof(buf));
+  key_of(key, 10200);
+  assert(batch_add_scan(b, key, key_len, &s) == 1);
+  run_batch(pt, b);
+  check_scan(&s, 10200, 2, 20);
+
+#ifdef Test
+  palm_tree_validate(pt);
+#endif
+
+  free_batch(b);
+  free_palm_tree(pt);
+}
+
+// deletes merge leaves and branches until the root collapses, the tree stays valid on the way
+static void test_delete_merge(int threads)
+{
+  printf("test delete merge, %d workers\n", threads);
+
+  palm_tree *pt = new_palm_tree(threads, 1);
+  // sizes are not rounded, leaf takes multiples of 4kb and branch takes multiples of 1kb
+  assert(palm_tree_set_node_size(pt, 4096, 1500) == -1);
+  assert(palm_tree_set_node_size(pt, 5120, 1024) == -1);
+  assert(palm_tree_set_node_size(pt, 4096, 512) == -1);
+  // small branch nodes so that there are a few levels to merge
+  assert(palm_tree_set_node_size(pt, 4096, 1024) == 0);
+  batch *b = new_batch();
+  load_keys(pt, b, 0, 40000, 1);
+  uint32_t height = pt->root->level;
+  // sizes can't change once the tree has keys
+  assert(palm_tree_set_node_size(pt, 8192, 2048) == -1);
+
+  // keep one of every 64 keys
+  for (uint32_t r = 1; r < 64; ++r)
+    apply_keys(pt, b, Delete, r, 40000, 64, Deleted);
+  apply_keys(pt, b, Read, 0, 40000, 64, Found);
+  apply_keys(pt, b, Read, 1, 40000, 64, NotFound);
+  apply_keys(pt, b, Delete, 3, 40000, 64, NotFound);
+  // leaves and branches of different workers are not merged
+  assert(pt->root->level <= height);
+  if (threads == 1)
+    assert(pt->root->level < height);
+#ifdef Test
+  palm_tree_validate(pt);
+#endif
+
+  // scan sees exactly the keys left
+  char key[key_len], buf[4096];
+  scan s;
+  scan_init(&s, 0, 0, 100, buf, sizeof(buf));
+  key_of(key, 1);
+  assert(batch_add_scan(b, key, key_len, &s) == 1);
+  run_batch(pt, b);
+  check_scan(&s, 64, 64, 100);
+  batch_clear(b);
+
+  apply_keys(pt, b, Delete, 0, 40000, 64, Deleted);
+  apply_keys(pt, b, Read, 0, 40000, 1, NotFound);
+#ifdef Test
+  palm_tree_validate(pt);
+#endif
+
+  // and the tree still works
+  load_keys(pt, b, 0, 2000, 1);
+  apply_keys(pt, b, Read, 0, 2000, 1, Found);
+  free_palm_tree(pt);
+
+  // a batch that empties all the leaves of a worker collapses the root,
+  // a few leaves of fixed keys or of variable length keys
+  pt = new_palm_tree(threads, 1);
+  assert(palm_tree_set_node_size(pt, 4096, 1024) == 0);
+  batch_set_segments(b, 4);
+  load_keys(pt, b, 0, 400, 1);
+  assert(pt->root->level);
+  apply_keys(pt, b, Delete, 0, 400, 1, Deleted);
+  if (threads == 1)
+    assert(pt->root->level == 0 && pt->root->keys == 0);
+  apply_keys(pt, b, Read, 0, 400, 1, NotFound);
+
+  free_batch(b);
+  free_palm_tree(pt);
+}
+
+// a chained batch gives a worker more paths than its initial `max_path`, grown paths must be
+// as clean as the initial ones under every descend policy
+static void test_path_growth(int threads)
+{
+  printf("test path growth, %d workers\n", threads);
+
+  batch *b = new_batch();
+  batch_set_segments(b, 8);
+  for (uint32_t policy = DescendLazy; policy <= DescendAdaptive; ++policy) {
+    palm_tree *pt = new_palm_tree(threads, 1);
+    palm_tree_set_descend_policy(pt, policy);
+    uint32_t max_path = pt->workers[0]->max_path;
+
+    load_keys(pt, b, 0, 20000, 1);
+    assert(pt->workers[0]->max_path > max_path);
+    apply_keys(pt, b, Write, 0, 20000, 1, Updated);
+    apply_keys(pt, b, Read, 0, 20000, 1, Found);
+#ifdef Test
+    palm_tree_validate(pt);
+#endif
+    free_palm_tree(pt);
+  }
+  free_batch(b);
+}
+
+// add, compare-and-swap and get-or-insert on keys in the tree and not in the tree
+static void test_atomic_ops(int threads)
+{
+  printf("test atomic ops, %d workers\n", threads);
+
+  palm_tree *pt = new_palm_tree(threads, 1);
+  batch *b = new_batch();
+  batch_set_segments(b, 8);
+  const uint32_t n = 3000;
+  model m;
+  m.vals = (uint64_t *)calloc(n, sizeof(uint64_t));
+  m.count = 0;
+
+  // even keys are in the tree
+  load_keys(pt, b, 0, n / 3, 2);
+  for (uint32_t i = 0; i < n / 3; i += 2)
+    m.vals[i] = i + 1;
+
+  for (uint32_t i = 0; i < n / 3; ++i)
+    model_add(&m, pt, b, Add, i, 10, 0);
+  model_run(&m, pt, b);
+
+  // the new thirds are inserted, the others keep their values
+  for (uint32_t i = 0; i < n * 2 / 3; ++i)
+    model_add(&m, pt, b, GetOrInsert, i, 7, 0);
+  model_run(&m, pt, b);
+
+  // one in three swaps, the rest mismatch, and nothing is inserted for the last third
+  for (uint32_t i = 0; i < n; ++i) {
+    uint64_t cur = m.vals[i];
+    model_add(&m, pt, b, Cas, i, i + 100, i % 3 ? cur + 1 : cur);
+  }
+  model_run(&m, pt, b);
+
+  model_check(&m, pt, b, n);
+#ifdef Test
+  palm_tree_validate(pt);
+#endif
+
+  free(m.vals);
+  free_batch(b);
+  free_palm_tree(pt);
+}
+
+// every key shows up several times in a batch with all kinds of operations, they take effect in
+// the order they are added, in a single batch and in a chained batch that has to be sorted
+static void test_duplicate_keys(int threads)
+{
+  printf("test duplicate keys, %d workers\n", threads);
+
+  static const uint32_t ops[] = {Write, Add, Cas, GetOrInsert, Delete, Read, Add, Cas};
+  const uint32_t n = 2000, rounds = 8;
+  batch *b = new_batch();
+  model m;
+  m.vals = (uint64_t *)calloc(n, sizeof(uint64_t));
+  for (uint32_t segments = 1; segments <= 8; segments *= 8) {
+    palm_tree *pt = new_palm_tree(threads, 1);
+    batch_set_segments(b, segments);
+    memset(m.vals, 0, sizeof(uint64_t) * n);
+    m.count = 0;
+
+    load_keys(pt, b, 0, n, 2);
+    for (uint32_t i = 0; i < n; i += 2)
+      m.vals[i] = i + 1;
+    // keys of a block take turns, so that a batch has every one of them several times
+    for (uint32_t beg = 0; beg < n; beg += 16) {
+      for (uint32_t r = 0; r < rounds; ++r) {
+        for (uint32_t i = beg; i < beg + 16; ++i) {
+          uint32_t op = ops[(i * 7 + r * 3) % (sizeof(ops) / sizeof(ops[0]))];
+          uint64_t cur = m.vals[i];
+          model_add(&m, pt, b, op, i, i * rounds + r + 1, (i + r) % 2 ? cur : cur + 1);
+        }
+      }
+    }
+    model_run(&m, pt, b);
+    model_check(&m, pt, b, n);
+#ifdef Test
+    palm_tree_validate(pt);
+#endif
+    free_palm_tree(pt);
+  }
+  free(m.vals);
+
+  // a run longer than `max_kv_run` is split into several paths, still in order
+  palm_tree *pt = new_palm_tree(threads, 1);
+  batch_set_segments(b, 1024);
+  char key[key_len];
+  key_of(key, 1);
+  const uint32_t run = max_kv_run + 1000;
+  for (uint32_t i = 0; i < run; ++i)
+    assert(batch_add_add(b, key, key_len, (void *)1) == 1);
+  run_batch(pt, b);
+  for (uint32_t seq = 0; seq < run; ++seq) {
+    void *val;
+    assert(batch_get_result(b, seq, &val) == (seq ? Updated : Inserted));
+    assert((uint64_t)val == (seq ? seq : 0));
+  }
+  batch_clear(b);
+  assert(batch_add_read(b, key, key_len) == 1);
+  run_batch(pt, b);
+  void *val;
+  assert(batch_get_result(b, 0, &val) == Found && (uint64_t)val == run);
+
+  free_batch(b);
+  free_palm_tree(pt);
+}
+
+// all the keys of a batch fall into one or two leaves of a populated tree, so after the slice
+// cut most workers have nothing to do and the others share the same leaves
+static void test_narrow_batch(int threads)
+{
+  printf("test narrow batch, %d workers\n", threads);
+
+  palm_tree *pt = new_palm_tree(threads, 1);
+  assert(palm_tree_set_node_size(pt, 4096, 1024) == 0);
+  batch *b = new_batch();
+  // there are 99 free keys between two keys of the tree
+  load_keys(pt, b, 0, 100000, 100);
+  assert(pt->root->level);
+
+  // one leaf, which splits during the batch
+  apply_keys(pt, b, Write, 50001, 50100, 1, Inserted);
+  apply_keys(pt, b, Read, 50000, 50101, 1, Found);
+  apply_keys(pt, b, Delete, 50001, 50100, 1, Deleted);
+#ifdef Test
+  palm_tree_validate(pt);
+#endif
+
+  // two leaves far apart
+  uint32_t ops[3] = {Write, Read, Delete}, status[3] = {Inserted, Found, Deleted};
+  for (uint32_t o = 0; o < 3; ++o) {
+    batch_clear(b);
+    for (uint32_t i = 20001; i < 20100; ++i)
+      assert(add_key(b, ops[o], i) == 1);
+    for (uint32_t i = 80001; i < 80100; ++i)
+      assert(add_key(b, ops[o], i) == 1);
+    run_batch(pt, b);
+    for (uint32_t seq = 0, i = 20001; i < 80100; ++seq, i = i == 20099 ? 80001 : i + 1) {
+      void *val;
+      assert(batch_get_result(b, seq, &val) == status[o]);
+      if (ops[o] != Write)
+        assert((uint64_t)val == i + 1);
+    }
+  }
+#ifdef Test
+  palm_tree_validate(pt);
+#endif
+
+  apply_keys(pt, b, Read, 0, 100000, 100, Found);
+  apply_keys(pt, b, Read, 20001, 20100, 1, NotFound);
+  apply_keys(pt, b, Read, 50001, 50100, 1, NotFound);
+  free_batch(b);
+  free_palm_tree(pt);
+}
+
+// keys come in scattered order, so that leaves fill up everywhere and keys are moved between
+// neighbours before splitting, then most of them are deleted so that leaves merge
+static void test_scattered_keys(int threads)
+{
+  printf("test scattered keys, %d workers\n", threads);
+
+  palm_tree *pt = new_palm_tree(threads, 1);
+  assert(palm_tree_set_node_size(pt, 4096, 1024) == 0);
+  batch *b = new_batch();
+  const uint32_t n = 60000, prime = 7919;
+  model m;
+  m.vals = (uint64_t *)calloc(n, sizeof(uint64_t));
+  m.count = 0;
+
+  for (uint32_t j = 0; j < n; ++j)
+    model_add(&m, pt, b, Write, (j * prime) % n, j + 1, 0);
+  model_run(&m, pt, b);
+  model_check(&m, pt, b, n);
+#ifdef Test
+  palm_tree_validate(pt);
+#endif
+
+  // keep one of every 4 keys
+  for (uint32_t j = 0; j < n; ++j)
+    if ((j * prime) % n % 4)
+      model_add(&m, pt, b, Delete, (j * prime) % n, 0, 0);
+  model_run(&m, pt, b);
+  model_check(&m, pt, b, n);
+#ifdef Test
+  palm_tree_validate(pt);
+#endif
+
+  // and fill them up again
+  for (uint32_t j = 0; j < n; ++j)
+    model_add(&m, pt, b, Write, (j * prime) % n, j + 2, 0);
+  model_run(&m, pt, b);
+  model_check(&m, pt, b, n);
+#ifdef Test
+  palm_tree_validate(pt);
+#endif
+
+  free(m.vals);
+  free_batch(b);
+  free_palm_tree(pt);
+}
+
+#ifndef FixedKey
+// keys of 64 to 100 bytes in the order of `i`, they share a prefix of 56 bytes, return key length
+static uint32_t long_key_of(char *key, uint32_t i)
+{
+  uint32_t len = 64 + i % 37;
+  memset(key, 'p', 56);
+  snprintf(key + 56, 9, "%08u", i);
+  for (uint32_t j = 64; j < len; ++j)
+    key[j] = 'a' + (i * 31 + j) % 26;
+  return len;
+}
+
+// add `op` for long keys in [beg, end) by `step` in one batch, result of key `i` should be `status`
+static void apply_long_keys(palm_tree *pt, batch *b, uint32_t op, uint32_t beg, uint32_t end,
+  uint32_t step, uint32_t status)
+{
+  char key[128];
+  batch_clear(b);
+  for (uint32_t i = beg; i < end; i += step) {
+    uint32_t len = long_key_of(key, i);
+    assert((op == Read   ? batch_add_read(b, key, len) :
+            op == Delete ? batch_add_delete(b, key, len) :
+                           batch_add_write(b, key, len, (void *)(uint64_t)(i + 1))) == 1);
+  }
+  run_batch(pt, b);
+  check_results(b, beg, end, step, status);
+  batch_clear(b);
+}
+
+// every batch splits or merges hundreds of nodes with long fence keys, so fence keys of a worker
+// take more than one arena chunk, and the chunks are reused by the batches after
+static void test_long_keys(int threads)
+{
+  printf("test long keys, %d workers\n", threads);
+
+  palm_tree *pt = new_palm_tree(threads, 1);
+  assert(palm_tree_set_node_size(pt, 4096, 1024) == 0);
+  batch *b = new_batch();
+  batch_set_segments(b, 1024);
+  const uint32_t n = 40000;
+
+  apply_long_keys(pt, b, Write, 0, n, 2, Inserted);
+  apply_long_keys(pt, b, Write, 1, n, 2, Inserted);
+  apply_long_keys(pt, b, Read, 0, n, 1, Found);
+#ifdef Test
+  palm_tree_validate(pt);
+  uint32_t chunks = 0;
+  for (int i = 0; i < threads; ++i)
+    for (fence_chunk *c = pt->workers[i]->arenas[0].head; c; c = c->next)
+      ++chunks;
+  assert(chunks > (uint32_t)threads);
+#endif
+
+  // keep one of every 8 keys
+  for (uint32_t r = 1; r < 8; ++r)
+    apply_long_keys(pt, b, Delete, r, n, 8, Deleted);
+  apply_long_keys(pt, b, Read, 0, n, 8, Found);
+  apply_long_keys(pt, b, Read, 1, n, 8, NotFound);
+  apply_long_keys(pt, b, Write, 1, n, 2, Inserted);
+  apply_long_keys(pt, b, Read, 1, n, 2, Found);
+#ifdef Test
+  palm_tree_validate(pt);
+#endif
+
+  free_batch(b);
+  free_palm_tree(pt);
+}
+#endif // FixedKey
+
+#ifdef Test
+// workers 0 and 2 sleep before each of their leaf groups, so workers 1 and 3 steal their leaves,
+// splits and merges of the stolen leaves still leave a valid tree
+static void test_steal()
+{
+  printf("test steal, 4 workers\n");
+
+  palm_tree *pt = new_palm_tree(4, 1);
+  batch *b = new_batch();
+  // big batches over the whole tree, so that every worker has a lot of leaves
+  batch_set_segments(b, 8);
+  load_keys(pt, b, 0, 40000, 2);
+  worker_set_delay(pt->workers[0], 100);
+  worker_set_delay(pt->workers[2], 100);
+
+  apply_keys(pt, b, Write, 1, 40000, 4, Inserted);
+  apply_keys(pt, b, Write, 0, 40000, 2, Updated);
+  apply_keys(pt, b, Read, 1, 40000, 4, Found);
+  apply_keys(pt, b, Read, 3, 40000, 4, NotFound);
+  palm_tree_validate(pt);
+
+  // keep keys 0, 8, 16 ...
+  for (uint32_t r = 1; r < 8; ++r)
+    apply_keys(pt, b, Delete, r, 40000, 8, r % 4 == 3 ? NotFound : Deleted);
+  apply_keys(pt, b, Read, 0, 40000, 8, Found);
+  apply_keys(pt, b, Read, 1, 40000, 2, NotFound);
+  palm_tree_validate(pt);
+
+  uint32_t stolen = 0;
+  for (uint32_t i = 0; i < 4; ++i)
+    stolen += pt->workers[i]->stolen;
+  assert(stolen);
+
+  free_batch(b);
+  free_palm_tree(pt);
+}
+#endif
+
+// consecutive batches are in the queue together, so workers descend for the next batch while
+// worker 0 grows or shrinks the root of current one
+static void test_pipeline(int threads, int park)
+{
+  printf("test pipeline, %d workers%s\n", threads, park ? ", park" : "");
+
+  palm_tree *pt = new_palm_tree(threads, pipe_depth);
+  // waiting workers park right away instead of spinning
+  if (park)
+    palm_tree_set_spin(pt, 0);
+  assert(palm_tree_set_node_size(pt, 4096, 1024) == 0);
+  batch *bs[pipe_depth];
+  for (uint32_t i = 0; i < pipe_depth; ++i)
+    bs[i] = new_batch();
+
+  // root grows and shrinks again and again, every batch spreads over the whole tree,
+  // so a descent from an old root goes wrong
+  for (int i = 0; i < 8; ++i) {
+    pipe_keys(pt, bs, Write, 0, 8000, 32, 32, Inserted);
+    pipe_keys(pt, bs, Read, 0, 8000, 1, 1, Found);
+    pipe_keys(pt, bs, Delete, 0, 8000, 32, 32, Deleted);
+  }
+
+  // odd keys go between the even ones all over the tree
+  pipe_keys(pt, bs, Write, 0, 60000, 2, 2, Inserted);
+  uint32_t height = pt->root->level;
+  assert(height >= 2);
+  pipe_keys(pt, bs, Write, 0, 60000, 1, 1, Updated);
+  pipe_keys(pt, bs, Read, 0, 60000, 1, 1, Found);
+  pipe_keys(pt, bs, Delete, 1, 60000, 16, 15, Deleted);
+  pipe_keys(pt, bs, Read, 0, 60000, 16, 1, Found);
+  pipe_keys(pt, bs, Read, 1, 60000, 16, 1, NotFound);
+#ifdef Test
+  palm_tree_validate(pt);
+#endif
+  pipe_keys(pt, bs, Delete, 0, 60000, 16, 1, Deleted);
+  pipe_keys(pt, bs, Read, 0, 60000, 1, 1, NotFound);
+  if (threads == 1)
+    assert(pt->root->level < height);
+  pipe_keys(pt, bs, Write, 0, 60000, 3, 1, Inserted);
+  pipe_keys(pt, bs, Read, 0, 60000, 3, 1, Found);
+#ifdef Test
+  palm_tree_validate(pt);
+#endif
+
+  for (uint32_t i = 0; i < pipe_depth; ++i)
+    free_batch(bs[i]);
+  free_palm_tree(pt);
+}
+
+#define producers    4
+#define per_producer 4000
+#define window       32
+
+typedef struct producer_arg
+{
+  batcher           *bt;
+  uint32_t           id;
+  pthread_barrier_t *barrier;
+}producer_arg;
+
+// count kvs in finished batches
+static void count_done(void *b, void *arg)
+{
+  __sync_fetch_and_add((uint64_t *)arg, batch_get_keys((batch *)b));
+}
+
+// producer `id` writes keys `id`, `id + producers` ... and reads them back, results of every
+// `window` kvs are collected through their handles, producers go window by window together so
+// that a batch is not reused before its results are read
+static void* run_producer(void *arg)
+{
+  producer_arg *pa = (producer_arg *)arg;
+  uint32_t total = producers * per_producer;
+  uint64_t handles[window];
+  char key[key_len];
+
+  for (uint32_t op = Write; ; op = Read) {
+    for (uint32_t i = pa->id; i < total; ) {
+      uint32_t n = 0, first = i;
+      pthread_barrier_wait(pa->barrier);
+      for (; n < window && i < total; ++n, i += producers) {
+        key_of(key, i);
+        handles[n] = op == Write ? batcher_add_write(pa->bt, key, key_len, (void *)(uint64_t)(i + 1)) :
+                                   batcher_add_read(pa->bt, key, key_len);
+      }
+      for (uint32_t j = 0, k = first; j < n; ++j, k += producers) {
+        void *val;
+        uint32_t status = batcher_get_result(pa->bt, handles[j], &val);
+        if (op == Write) {
+          assert(status == Inserted);
+        } else {
+          assert(status == Found && (uint64_t)val == k + 1);
+        }
+      }
+    }
+    if (op == Read) break;
+  }
+  return 0;
+}
+
+// several producers share a batcher, then a single kv is sealed by the deadline
+static void test_batcher(int threads, int park)
+{
+  printf("test batcher, %d workers%s\n", threads, park ? ", park" : "");
+
+  palm_tree *pt = new_palm_tree(threads, 4);
+  if (park)
+    palm_tree_set_spin(pt, 0);
+  uint64_t done = 0;
+  batcher *bt = new_batcher(pt, 16, 20000 /* us */, count_done, (void *)&done);
+
+  pthread_t ids[producers];
+  producer_arg args[producers];
+  pthread_barrier_t barrier;
+  assert(pthread_barrier_init(&barrier, 0, producers) == 0);
+  for (uint32_t i = 0; i < producers; ++i) {
+    args[i].bt = bt;
+    args[i].id = i;
+    args[i].barrier = &barrier;
+    assert(pthread_create(&ids[i], 0, run_producer, (void *)&args[i]) == 0);
+  }
+  for (uint32_t i = 0; i < producers; ++i)
+    assert(pthread_join(ids[i], 0) == 0);
+  pthread_barrier_destroy(&barrier);
+
+  uint64_t total = producers * per_producer * 2;
+  assert(__atomic_load_n(&done, __ATOMIC_ACQUIRE) == total);
+
+  // nobody flushes or asks for the result, only the timer seals the batch
+  char key[key_len];
+  key_of(key, 0);
+  uint64_t handle = batcher_add_add(bt, key, key_len, (void *)(uint64_t)7);
+  for (int i = 0; i < 2000 && __atomic_load_n(&done, __ATOMIC_ACQUIRE) == total; ++i)
+    usleep(1000);
+  assert(__atomic_load_n(&done, __ATOMIC_ACQUIRE) == total + 1);
+  void *val;
+  assert(batcher_get_result(bt, handle, &val) == Updated && (uint64_t)val == 1);
+
+  free_batcher(bt);
+#ifdef Test
+  palm_tree_validate(pt);
+#endif
+  free_palm_tree(pt);
+}
+
+// with 2 batches in rotation, sealing a batch reuses the one sealed before it
+static void test_batcher_expired(int threads)
+{
+  printf("test batcher expired, %d workers\n", threads);
+
+  palm_tree *pt = new_palm_tree(threads, 4);
+  batcher *bt = new_batcher(pt, 2, 0, 0, 0);
+
+  char key[key_len];
+  uint64_t handles[2];
+  for (uint32_t i = 0; i < 2; ++i) {
+    key_of(key, i);
+    handles[i] = batcher_add_write(bt, key, key_len, (void *)(uint64_t)(i + 1));
+    batcher_flush(bt);
+  }
+
+  void *val = (void *)(uint64_t)-1;
+  assert(batcher_get_result(bt, handles[0], &val) == Expired && (uint64_t)val == (uint64_t)-1);
+  assert(batcher_get_result(bt, handles[1], &val) == Inserted);
+
+  // current batch is sealed to get the result, which reuses the batch of `handles[1]`
+  key_of(key, 0);
+  uint64_t handle = batcher_add_read(bt, key, key_len);
+  assert(batcher_get_result(bt, handle, &val) == Found && (uint64_t)val == 1);
+  assert(batcher_get_result(bt, handles[1], &val) == Expired);
+
+  free_batcher(bt);
+#ifdef Test
+  palm_tree_validate(pt);
+#endif
+  free_palm_tree(pt);
+}
+
+#define submit_rounds 200
+#define submit_keys   8
+
+typedef struct submitter_arg
+{
+  palm_tree *pt;
+  uint32_t   id;
+  uint64_t  *tickets; // ticket of each round
+  uint32_t  *runs;    // how many times the batch of each round is finished
+}submitter_arg;
+
+// count the runs of the batch of one round
+static void count_run(void *b, void *arg)
+{
+  (void)b;
+  __sync_fetch_and_add((uint32_t *)arg, 1);
+}
+
+// producer `id` submits a batch of `submit_keys` new keys each round, two batches in turn, so the
+// batch of a round is reused two rounds later, after its ticket is done and its results are checked
+static void* run_submitter(void *arg)
+{
+  submitter_arg *sa = (submitter_arg *)arg;
+  batch *bs[2] = {new_batch(), new_batch()};
+  uint64_t last = 0;
+
+  for (uint32_t r = 0; r < submit_rounds + 2; ++r) {
+    batch *b = bs[r % 2];
+    if (r >= 2) {
+      palm_tree_wait(sa->pt, sa->tickets[r - 2]);
+      assert(sa->runs[r - 2] == 1);
+      check_results(b, 0, submit_keys, 1, Inserted);
+    }
+    if (r >= submit_rounds) continue;
+
+    batch_clear(b);
+    for (uint32_t j = 0; j < submit_keys; ++j)
+      assert(add_key(b, Write, (r * producers + sa->id) * submit_keys + j) == 1);
+    uint64_t ticket = palm_tree_execute_callback(sa->pt, b, count_run, (void *)&sa->runs[r]);
+    // tickets of one producer go up
+    assert(ticket > last);
+    sa->tickets[r] = last = ticket;
+  }
+
+  free_batch(bs[0]);
+  free_batch(bs[1]);
+  return 0;
+}
+
+// several producers submit batches into the smallest queue, which is full most of the time,
+// every batch gets its own ticket and is finished exactly once
+static void test_submitters(int threads)
+{
+  printf("test submitters, %d workers\n", threads);
+
+  palm_tree *pt = new_palm_tree(threads, 1);
+  uint64_t tickets[producers][submit_rounds];
+  uint32_t runs[producers][submit_rounds];
+  memset(runs, 0, sizeof(runs));
+
+  pthread_t ids[producers];
+  submitter_arg args[producers];
+  for (uint32_t i = 0; i < producers; ++i) {
+    args[i].pt = pt;
+    args[i].id = i;
+    args[i].tickets = tickets[i];
+    args[i].runs = runs[i];
+    assert(pthread_create(&ids[i], 0, run_submitter, (void *)&args[i]) == 0);
+  }
+  for (uint32_t i = 0; i < producers; ++i)
+    assert(pthread_join(ids[i], 0) == 0);
+
+  // tickets are exactly 1 ... producers * submit_rounds, so none of them is shared or skipped
+  uint32_t total = producers * submit_rounds;
+  char seen[total + 1];
+  memset(seen, 0, sizeof(seen));
+  for (uint32_t i = 0; i < producers; ++i) {
+    for (uint32_t r = 0; r < submit_rounds; ++r) {
+      assert(tickets[i][r] >= 1 && tickets[i][r] <= total && !seen[tickets[i][r]]);
+      seen[tickets[i][r]] = 1;
+      assert(runs[i][r] == 1);
+    }
+  }
+
+  batch *b = new_batch();
+  apply_keys(pt, b, Read, 0, total * submit_keys, 1, Found);
+#ifdef Test
+  palm_tree_validate(pt);
+#endif
+  free_batch(b);
+  free_palm_tree(pt);
+}
+
 int main(int argc, char **argv)
 {
+  if (argc == 1) {
+    set_node_size(4096);
+    set_batch_size(8192);
+    test_scan_after_split(1);
+    test_scan_after_split(4);
+    test_delete_merge(1);
+    test_delete_merge(4);
+    // worker numbers that are not powers of 2 merge fences of uneven worker groups
+    test_delete_merge(3);
+    test_delete_merge(5);
+    test_delete_merge(6);
+    test_path_growth(1);
+    test_path_growth(2);
+    test_path_growth(3);
+    test_path_growth(5);
+    test_path_growth(6);
+    test_pipeline(1, 0);
+    test_pipeline(4, 0);
+    test_pipeline(4, 1);
+    test_atomic_ops(1);
+    test_atomic_ops(4);
+    test_duplicate_keys(1);
+    test_duplicate_keys(4);
+    test_scattered_keys(1);
+    test_scattered_keys(4);
+    test_narrow_batch(2);
+    test_narrow_batch(4);
+    test_narrow_batch(6);
+#ifndef FixedKey
+    test_long_keys(1);
+    test_long_keys(4);
+#endif
+#ifdef Test
+    test_steal();
+#endif
+    test_batcher(1, 0);
+    test_batcher(4, 0);
+    test_batcher(4, 1);
+    test_batcher_expired(1);
+    test_batcher_expired(4);
+    test_submitters(1);
+    test_submitters(4);
+    return 0;
+  }
+
   if (argc < 7) {
-    printf("file_name node_size batch_size thread_number queue_size key_number\n");
+    printf("file_name node_size batch_size thread_number queue_size key_number [branch_size]\n");
+    printf("run without argument for self-contained tests\n");
     exit(1);
   }
 
@@ -169,6 +1147,7 @@ int main(int argc, char **argv)
   thread_number = atoi(argv[4]);
   queue_size = atoi(argv[5]);
   total_keys = atoi(argv[6]);
+  branch_size = argc > 7 ? atoi(argv[7]) : 0;
   if (total_keys <= 0) total_keys = 1;
   if (queue_size <= 0) queue_size = 1;
   if (thread_number <= 0) thread_number = 1;